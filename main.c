@@ -1,4 +1,5 @@
-#define _XOPEN_SOURCE // Compiler gives warning for wcwidth when this is not defined
+#define _XOPEN_SOURCE 700 // Compiler gives warning for wcwidth when this is not defined, 700 is needed for clock_gettime
+#define _GNU_SOURCE // Needed for d_type of directory entries and fopencookie
 #include <ctype.h>
 #include <stdlib.h>
 #include <string.h>
@@ -14,6 +15,16 @@
 #include <sys/stat.h>
 #include <fcntl.h> 
 #include <sys/ioctl.h>
+#include <poll.h>
+#include <time.h>
+#include <regex.h>
+#include <dirent.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sched.h>
+#include <sys/resource.h>
+#include <sys/syscall.h>
 
 #define CAPACIY_INCREMENT 10
 
@@ -21,6 +32,40 @@
 
 #define JUST_ECHO 0 // If it is 1 just echos back command instead of running it
 
+#define CAPTURE_BENCHMARK 0 // If it is 1 measures speed of command substitution for outputs from 1 KB to 100 MB and exits
+
+#define SYNTAX_HIGHLIGHT 1 // Colors the command while it is typed
+
+#define COMMAND_CACHE_SIZE 64 // Bucket count of command lookup cache used by syntax highlighting
+
+#define VARIABLE_TABLE_SIZE 128 // Bucket count of shell variables hash table
+#define DEFINITION_TABLE_SIZE 64 // Bucket count of alias and function tables
+#define FUNCTION_DEPTH_LIMIT 256 // Deeper function calls fail instead of exhausting stack
+
+#define PROMPT_SEGMENT_SIZE 64 // Maximum length of text of a prompt segment
+
+#define EDIT_LOG_LIMIT (64*1024) // Bytes of undo records kept for current line, oldest are dropped beyond it
+#define KILL_RING_SIZE 16 // Killed texts kept for yanking
+
+#define RELAY_BUFFER_SIZE 65536 // How much output of a command read at once, also minimum free space while capturing
+#define SCROLLBACK_SIZE (4*1024*1024) // How much of recent command output kept in memory
+
+#define CAPTURE_CHUNK_SIZE 65536 // Output captured for history is stored in chunks of this size
+#define CAPTURE_MEMORY_LIMIT (32*1024*1024) // Captured output beyond this moved to a temporary file, oldest first
+#define CAPTURE_SPILL_LIMIT (512L*1024*1024) // Temporary file never grows beyond this, oldest spilled output is dropped instead
+
+#define RECORD_BUFFER_SIZE (256*1024) // Initial size of each of two buffers of session recorder
+#define RECORD_FLUSH_SIZE (64*1024) // Recorder thread is woken when this much is buffered or a command is committed
+#define RECORD_BUFFER_LIMIT (32*1024*1024) // Shell waits for recorder thread only when this much is waiting for disk
+
+#define WATCH_BACKOFF_LIMIT 8 // Wait after a command slower than interval of watch doubles up to this many intervals
+
+#define PROFILE_INTERVAL 10 // Milliseconds between samples of a profiled pipeline
+#define PROFILE_PIPE_LIMIT (1024*1024) // profile -g grows pipes up to this size
+
+#define GLOB_THREADS 8 // Maximum threads that read directories in parallel for ** patterns
+#define GLOB_CACHE_SIZE 256 // Initial bucket count of directory cache, it doubles as directories are added
+
 #define ADJUST_CAPACITY(array, count, minFree ,elementSize) \
     if( (count+minFree) % CAPACIY_INCREMENT == 0) \
         array = realloc(array, elementSize * (count + minFree + CAPACIY_INCREMENT));
@@ -31,16 +76,392 @@ typedef struct{
 }cursor_position;
 
 
+typedef struct capture_chunk{
+    struct capture_chunk *next;
+    char *data; // NULL if chunk is moved to spill file
+    long offset; // Position of chunk's slot in spill file
+    int length;
+}capture_chunk;
+
+// Output of a command, oldest chunks are dropped when it exceeds limit so only the last part is kept
+typedef struct{
+    capture_chunk *first;
+    capture_chunk *last;
+    long size; // Bytes kept
+    long dropped; // Bytes dropped from beginning
+}output_capture;
+
 typedef struct history_record{
     struct history_record *older;
     struct history_record *newer;
     char *command;
+    int number;
+    output_capture *output; // NULL if output is not captured
 }history_record;
 
+// Edits of current line as records of offset, removed bytes and inserted bytes packed one after another,
+// so undo and redo need no copies of whole line. Each record is header, removed bytes, inserted bytes and its size.
+typedef struct{
+    int offset;
+    int removed;
+    int inserted;
+}edit_header;
+
+typedef struct{
+    char *data;
+    long length;
+    long position; // Records after position are undone, they can be redone until a new edit
+    long capacity;
+    char coalesce; // Last record is typed text that next typed character extends
+}edit_log;
+
+// Editor actions that change what next key does
+#define ACTION_KILL 1 // Next kill is added to same kill ring entry
+#define ACTION_YANK 2 // Alt-Y replaces yanked text with older entry
+
+// Token types used by syntax highlighting
+#define SYNTAX_ARGUMENT 0
+#define SYNTAX_COMMAND 1 // Command that found in PATH or builtin
+#define SYNTAX_MISSING 2 // Command that could not be found
+#define SYNTAX_STRING 3
+#define SYNTAX_OPERATOR 4
+#define SYNTAX_REDIRECTION 5
+#define SYNTAX_ASSIGNMENT 6 // NAME=value before command
+
+// Lexer states that are stored with tokens so lexing can restart from any token
+#define LEX_COMMAND 0x1 // Next word is a command
+#define LEX_TARGET 0x2 // Next word is target of a redirection
+#define LEX_GLUED 0x4 // Token continues the word of previous token like "b" in a"b"
+
+typedef struct{
+    int start; // Index of first byte of token in content
+    int end; // Index after last byte of token
+    char type; // One of SYNTAX_ values
+    char lexState; // State of lexer at start of token
+}syntax_token;
+
+typedef struct command_cache_entry{
+    struct command_cache_entry *next;
+    char found;
+    char name[];
+}command_cache_entry;
+
+typedef struct{
+    char *name;
+    int (*run)(char **args); // Returns exit status like a command would
+}builtin_command;
+
+typedef struct shell_variable{
+    struct shell_variable *next;
+    char *name;
+    char *value;
+    char exported;
+}shell_variable;
+
+// Alias or function, its body is parsed once when it is defined
+typedef struct shell_definition{
+    struct shell_definition *next;
+    char *name;
+    char *text; // Alias as it is given, NULL for functions
+    struct command_list *body;
+    int running; // Calls of function that did not return yet
+    char active; // Alias is being replaced, so its name in its own body is left as is
+    char removed; // Redefined or unset while running, freed when last call returns
+}shell_definition;
+
+// Types of word parts, a word is expanded by joining its parts
+#define PART_LITERAL 0
+#define PART_SUBSTITUTION 1 // $(...) or `...`
+#define PART_VARIABLE 2 // $NAME or ${NAME}, text is name
+
+typedef struct{
+    char type;
+    char quoted; // Inside quotes, result is not split into words
+    char *text; // Text of literal
+    struct command_list *list; // Command of substitution
+}word_part;
+
+// Types of tokens of a parsed command
+#define TOKEN_WORD 0
+#define TOKEN_PIPE 1
+#define TOKEN_ASSIGNMENT 2 // NAME=value word before command
+#define TOKEN_SEPARATOR 3 // ; or new line between commands
+#define TOKEN_FUNCTION 4 // name() { body } definition, part is name
+#define TOKEN_HEREDOC 5 // Body of <<DELIMITER, given to command as standard input
+
+// Tokens after which next word is a command
+#define IS_COMMAND_BOUNDARY(type) ((type) == TOKEN_PIPE || (type) == TOKEN_SEPARATOR || (type) == TOKEN_ASSIGNMENT)
+
+typedef struct{
+    char type;
+    word_part *parts; // Only for words
+    int partCount;
+    struct command_list *body; // Only for function definitions
+}command_token;
+
+// Parsed form of a command, words are expanded just before running it
+typedef struct command_list{
+    command_token *tokens;
+    int count;
+}command_list;
+
+// Here-document whose body starts after current line
+typedef struct{
+    int token; // Index of TOKEN_HEREDOC token
+    char *delimiter;
+    char strip; // <<- removes tabs at start of lines
+    char quoted; // Delimiter has quotes, so body is not expanded
+}pending_heredoc;
+
+// Part of a here-document that is not written to command yet
+typedef struct{
+    char *data;
+    long length;
+    long written;
+}heredoc_writer;
+
+// State of parser while a command is being parsed
+typedef struct{
+    char *text;
+    int i; // Position in text
+    char *error; // Set when command is not valid
+    command_list *list;
+    command_token *word; // Word that is being parsed, NULL between words
+    char *literal; // Text collected for next literal part
+    int literalLength;
+    int literalCapacity;
+    char literalQuoted;
+    pending_heredoc *heredocs; // Here-documents of current line
+    int heredocCount;
+}command_parser;
+
+// Types of path components of a glob pattern
+#define GLOB_LITERAL 0 // Has no wildcards, used as is without reading directory
+#define GLOB_WILDCARD 1
+#define GLOB_RECURSIVE 2 // ** matches any number of directories
+
+// Types of steps of a compiled component
+#define GLOB_OP_CHAR 0
+#define GLOB_OP_ANY 1 // ?
+#define GLOB_OP_STAR 2 // *
+#define GLOB_OP_SET 3 // [...]
+
+typedef struct{
+    char type;
+    unsigned char ch;
+    unsigned char set[32]; // Bitmap of matching bytes for GLOB_OP_SET
+}glob_op;
+
+typedef struct{
+    char type; // One of GLOB_ values
+    char *text; // Unescaped text of literal component
+    glob_op *ops;
+    int opCount;
+    char dotMatched; // Starts with '.' so it can match hidden names
+}glob_component;
+
+// Pattern compiled once and matched against every directory entry
+typedef struct{
+    glob_component *components;
+    int count;
+    char absolute;
+    char directoryOnly; // Pattern ends with '/'
+}glob_pattern;
+
+#define GLOB_ENTRY_DIR 0x1
+#define GLOB_ENTRY_LINK 0x2
+
+typedef struct{
+    int name; // Offset of name in names of directory
+    char flags;
+}glob_entry;
+
+// Entries of a directory, read once and shared by all patterns of a command line
+typedef struct glob_dir{
+    struct glob_dir *next;
+    unsigned int hash;
+    char *path;
+    char *names;
+    glob_entry *entries;
+    int count;
+    char treeRead; // Whole tree under it is in cache
+}glob_dir;
+
+typedef struct{
+    glob_dir **buckets;
+    int bucketCount;
+    int count;
+    pthread_mutex_t lock; // Held by threads reading a tree while they use cache
+}glob_cache;
+
+// Directories waiting to be read by threads of a ** traversal
+typedef struct{
+    char **paths;
+    int count;
+    int capacity;
+    int busy; // Threads reading a directory, they may add more paths
+    pthread_mutex_t lock;
+    pthread_cond_t changed;
+}glob_queue;
+
+typedef struct{
+    char **paths;
+    int count;
+    int capacity;
+}glob_result;
+
+// Keeps last capacity bytes written to it
+typedef struct{
+    char *data;
+    long capacity;
+    long written; // Total bytes written, next byte goes to data[written % capacity]
+}output_ring;
+
+// A file descriptor that main loop watches while waiting for input
+typedef struct{
+    int fd;
+    short events; // POLLIN or POLLOUT
+    void (*handler)(int fd, void *data); // Called when fd becomes readable or writable
+    void *data;
+}event_source;
+
+// Types of events in session log. Each event is type byte, microseconds since previous event and length of data
+// as varints, then data. Log starts with RECORD_MAGIC and a RECORD_RESIZE event.
+#define RECORD_MAGIC "ALPREC1\n"
+#define RECORD_INPUT 1 // Bytes read from terminal
+#define RECORD_OUTPUT 2 // Bytes written to terminal
+#define RECORD_RESIZE 3 // Terminal width and height as varints
+#define RECORD_COMMAND 4 // Command that is committed
+#define RECORD_STATUS 5 // Exit status and duration in milliseconds of committed command as varints
+
+// Writes session log in a thread, events are only copied to a buffer while shell runs
+typedef struct{
+    int fd;
+    char *buffer; // Events are appended here
+    long length;
+    long capacity;
+    char *spare; // Buffer that thread writes to file
+    long spareCapacity;
+    int stopping;
+    pthread_t thread;
+    pthread_mutex_t lock;
+    pthread_cond_t ready;
+    pthread_cond_t drained; // Signalled when thread takes buffer
+    struct timespec last; // Time of previous event
+    FILE *terminal; // Stdout before recording, it is replaced by a stream that also records
+    long events;
+    long bytes;
+}session_recorder;
+
+// Output stream of a child that writes to a pipe, drops carriage returns that builtins put after newlines for raw terminal
+typedef struct{
+    int fd;
+    char newline; // Last byte written was a newline
+}line_end_filter;
+
+// Session log that shell reads its input from instead of terminal
+typedef struct{
+    FILE *file;
+    int fast; // Does not wait between events as in recorded session
+    long time; // Microseconds since start of log of last event read
+    long events;
+    struct timespec start;
+}session_replay;
+
+// Frames of control socket are type byte, request id and length of data as 4 byte big endian numbers, then data.
+// Client sends commands, shell answers each with any number of output frames and one exit frame.
+#define CONTROL_HEADER_SIZE 9
+#define CONTROL_FRAME_LIMIT (1024*1024) // Longest command accepted, client sending more is disconnected
+#define CONTROL_QUEUE_LIMIT (4*1024*1024) // Output waiting for a client that does not read, more disconnects it
+#define CONTROL_COMMAND 'C' // Command to run, from client
+#define CONTROL_STDOUT 'O'
+#define CONTROL_STDERR 'E'
+#define CONTROL_EXIT 'X' // Exit status of command as 4 byte big endian number
+
+typedef struct{
+    int fd; // -1 after client disconnected, kept until its requests end
+    char *input; // Bytes of frames not received completely
+    long inputLength;
+    long inputCapacity;
+    char *output; // Frames not written yet because socket was full
+    long outputLength;
+    long outputCapacity;
+    int requests; // Requests still running
+}control_client;
+
+// Command of a client running in a child, its stdout and stderr are forwarded to client as frames
+typedef struct{
+    control_client *client;
+    unsigned int id;
+    pid_t pid;
+    int open; // Output pipes that did not reach end of file
+}control_request;
+
+// CPUs and priorities given to stages by place, applied in child before exec
+typedef struct{
+    cpu_set_t cpus;
+    char hasCpus;
+    char hasNice;
+    int nice;
+    int ioPriority; // Class and level as ioprio_set takes them, -1 to keep shell's
+    char *cgroup; // Path under cgroup v2 mount, NULL to stay in cgroup of shell
+}stage_placement;
+
+// Process of a pipeline stage, where it ran is read from /proc before it is reaped so jobs -v can show it
+typedef struct{
+    pid_t pid;
+    char *name;
+    int ioPriority; // Given by place, -1 if inherited from shell
+    int status;
+    int processor; // CPU it ran on last
+    int nice;
+    long cpuTime; // Milliseconds in user and system mode, including its children
+    char *cpus; // CPUs it was allowed to run on
+    char *cgroup;
+    long readBytes; // Only read for profiled pipelines
+    long writtenBytes;
+}job_stage;
+
+// What a stage was doing in samples of profile
+typedef struct{
+    long samples; // Samples taken while it was alive
+    long running;
+    long inputWait; // Sleeping while its input pipe was empty
+    long outputWait; // Sleeping while its output pipe was full
+    long fill; // Sum of bytes in its input pipe over samples
+    long full; // Samples its input pipe was full
+    int capacity; // Size of its input pipe
+    int grown; // Capacity before it was grown, 0 if it was not
+}stage_profile;
+
+// Pipeline run by profile, stages are sampled by relayOutput while their output is relayed
+typedef struct{
+    int grow; // Pipes found full are grown so their writers block less
+    struct timespec start;
+    struct timespec lastSample;
+    long samples;
+    stage_profile *stages; // Indexed like state.stages
+    int count;
+}pipeline_profile;
+
+// Part of prompt that shows some information, async ones are computed in a child process so they never delay the prompt
+typedef struct{
+    char *name;
+    void (*compute)(char *text); // Fills text with at most PROMPT_SEGMENT_SIZE-1 chars, empty text hides segment
+    char *color;
+    char async;
+    char cwdDependent; // Cached text is dropped when directory changes
+    char enabled;
+    char pending; // Async computation is running
+    int generation; // state.cwdGeneration when computation started, result is stale if directory changed since
+    char text[PROMPT_SEGMENT_SIZE]; // Last computed text
+}prompt_segment;
+
 // Current command usually referred as current line even though it may consists of multiple line
 
 typedef struct{
     int terminalWidth; // How many columns terminal has
+    int terminalHeight; // How many lines terminal has, only used for output throttling
     //command_history history;
     history_record *history_last;
     history_record *history_pos; // 0 if current command is not loaded from history otherwise last loaded command's index in history
@@ -60,32 +481,158 @@ typedef struct{
     int expectedBytes; // How many bytes expected to complate multi byte char
     wchar_t wideChar;
 
+    edit_log edits;
+    char *killRing[KILL_RING_SIZE];
+    int killTop; // Index of last killed text
+    char action; // ACTION_ value set by key being processed
+    char lastAction; // ACTION_ value of previous key
+    int yankStart; // Text inserted by last yank, replaced by Alt-Y
+    int yankLength;
+    int yankIndex;
+
     char* cwd; // Current working directory
+    int cwdGeneration; // Counts directory changes
     int startingColumn; // Stores the length of prefix (<> )
+    char *prompt; // Prompt built from cwd and segments, startingColumn is its width
+    int promptChanged; // An async segment updated, prompt has to be repainted
+
+    int lastStatus; // Exit status of last command
+    long lastDuration; // How many milliseconds last command took
+    job_stage *stages; // Processes of pipeline that is running
+    int stageCount;
+    job_stage *job; // Stages of last pipeline that ended
+    int jobCount;
+    stage_placement placement; // Given to every stage unless place overrides it
+    pipeline_profile *profile; // NULL unless a pipeline is profiled
+
+    int outputFps; // When not 0 output of commands is written to terminal at most this many times per second
+    output_ring scrollback; // Recent output of commands
+
+    long captureLimit; // How many bytes of each command's output kept in history, 0 if capturing disabled
+    long captureMemory; // Bytes of captured output in memory
+    output_capture *capture; // Capture of running command
+    FILE *spillFile; // Captured chunks that do not fit in memory, each kept in a slot of CAPTURE_CHUNK_SIZE bytes
+    long spillSize; // Length of spill file
+    long spillUsed; // Bytes of slots that hold a chunk
+    long *spillFree; // Offsets of released slots, reused before file grows
+    int spillFreeCount;
+
+    shell_variable *variables[VARIABLE_TABLE_SIZE];
+    char **envp; // Exported variables as NAME=value, given to exec as environment
+    int envpValid; // Cleared when an exported variable changes so envp is built again only then
+    pid_t shellPid; // Expanded for $$, same in forked stages and subshells
+
+    shell_definition *aliases[DEFINITION_TABLE_SIZE];
+    shell_definition *functions[DEFINITION_TABLE_SIZE];
+    char **positional; // Arguments of running function, $1 is first one
+    int positionalCount;
+    int functionDepth;
+    int heredocWriters; // Here-documents being written to commands by event loop
+
+    session_recorder *recorder; // NULL if session is not recorded
+    session_replay *replay; // NULL if input comes from terminal
+    int controlFd; // Listening control socket, -1 if there is none
+    char *controlPath;
+
+    // Tokens of content, updated incrementally after each edit to color only changed parts
+    syntax_token *tokens;
+    int tokenCount;
+    int tokenCapacity;
+    char color; // Token type whose color is currently active in terminal, -1 for default
 }shell_state;
 
 
 void runCommand(char *command);
+void recordEvent(char type, const char *data, long length);
+void recordResize();
+void recordStatus();
+char replayInput();
 void addChar(char ch);
+void editLogClear();
+void editLogRecord(int offset, char *removed, int removedLength, char *inserted, int insertedLength, int typed);
 void enableRawMode();
 void disableRawMode();
 void updateCursorPos();
+void printLine();
+int builtinCd(char **args);
+int builtinPrompt(char **args);
+int builtinThrottle(char **args);
+int builtinScrollback(char **args);
+int builtinHistory(char **args);
+int builtinOutput(char **args);
+int builtinExport(char **args);
+int builtinUnset(char **args);
+int builtinAlias(char **args);
+int runFunction(shell_definition *function, char **args);
+int builtinUnalias(char **args);
+int builtinRecord(char **args);
+int builtinControl(char **args);
+int builtinPlace(char **args);
+int builtinJobs(char **args);
+int builtinProfile(char **args);
+int builtinWatch(char **args);
+void runArgs(char **args);
+void promptRefresh();
+void pipeLineEnds();
+void promptSegmentStart(prompt_segment *segment);
+void controlFinish(control_request *request);
+int syntaxUpdate(int start, int removed, int inserted);
 
 #define HEXCHAR(char) char & 0xff
 
-#define NEW_LINE() printf("\n\r\x1b[36m<%s>\x1b[0m ",state.cwd); \
+#define NEW_LINE() promptRefresh(); \
+    printf("\n\r%s", state.prompt); \
     state.curLine = state.startingColumn/state.terminalWidth; \
     state.curColumn = state.startingColumn %state.terminalWidth;
 
 #define ESCAPES_BACKSPACE 0x8
 #define ESCAPES_SINGLE 0x4
 #define ESCAPES_DOUBLE 0x2
+#define ESCAPES_HEREDOC 0x1
 
 // Globals
 struct termios termios_config;
 int resizeOccured = 0;
 shell_state state;
 int isChild = 0;
+char pipeMarker[] = "|"; // Separates commands of pipeline in args, compared by address since "|" can be an argument
+char assignMarker[] = "="; // Precedes NAME=value arg that sets environment of command
+char heredocMarker[] = "<<"; // Precedes body of here-document in args
+char unterminatedHeredoc[] = "Here-document is not terminated"; // Parser error, compared by address to continue line instead
+extern char **environ;
+command_cache_entry *commandCache[COMMAND_CACHE_SIZE];
+glob_cache globCache = {NULL, 0, 0, PTHREAD_MUTEX_INITIALIZER};
+
+event_source *eventSources;
+int eventSourceCount = 0;
+unsigned char inputBuffer[256]; // Bytes read from terminal but not processed yet
+int inputPos = 0;
+int inputLength = 0;
+
+builtin_command builtins[] = {
+    {"cd", builtinCd},
+    {"prompt", builtinPrompt},
+    {"throttle", builtinThrottle},
+    {"scrollback", builtinScrollback},
+    {"history", builtinHistory},
+    {"output", builtinOutput},
+    {"export", builtinExport},
+    {"unset", builtinUnset},
+    {"alias", builtinAlias},
+    {"unalias", builtinUnalias},
+    {"record", builtinRecord},
+    {"control", builtinControl},
+    {"place", builtinPlace},
+    {"jobs", builtinJobs},
+    {"profile", builtinProfile},
+    {"watch", builtinWatch},
+    {NULL, NULL}
+};
+
+#if SYNTAX_HIGHLIGHT
+    // Indexed by SYNTAX_ values
+    const char *syntaxColors[] = {"\e[0m", "\e[32m", "\e[31m", "\e[33m", "\e[35m", "\e[34m", "\e[36m"};
+#endif
 
 
 #if DEBUG_ENABLED
@@ -121,15 +668,88 @@ int isChild = 0;
 #endif
 
 
+void addEventSource(int fd, short events, void (*handler)(int fd, void *data), void *data){
+    ADJUST_CAPACITY(eventSources, eventSourceCount, 0, sizeof(event_source));
+    eventSources[eventSourceCount].fd = fd;
+    eventSources[eventSourceCount].events = events;
+    eventSources[eventSourceCount].handler = handler;
+    eventSources[eventSourceCount].data = data;
+    eventSourceCount++;
+}
+
+void removeEventSource(int fd){
+    int i;
+    for(i = 0; i < eventSourceCount; i++){
+        if(eventSources[i].fd == fd){
+            eventSources[i] = eventSources[--eventSourceCount];
+            return;
+        }
+    }
+}
+
+void setEventSourceEvents(int fd, short events){
+    int i;
+    for(i = 0; i < eventSourceCount; i++){
+        if(eventSources[i].fd == fd) eventSources[i].events = events;
+    }
+}
+
+// Waits until fd is readable or an event source becomes ready, events are handled before returning.
+// Returns 1 if fd is readable, 0 if only events handled or timeout reached and -1 if interrupted by a signal.
+int processEvents(int fd, int timeout){
+    int i, count, result;
+    struct pollfd *fds = malloc(sizeof(struct pollfd) * (eventSourceCount + 1));
+    event_source *ready;
+    fds[0].fd = fd;
+    fds[0].events = POLLIN;
+    for(i = 0; i < eventSourceCount; i++){
+        fds[i+1].fd = eventSources[i].fd;
+        fds[i+1].events = eventSources[i].events;
+    }
+    count = eventSourceCount;
+    result = poll(fds, count + 1, timeout);
+    if(result < 0){
+        free(fds);
+        return -1;
+    }
+    // Handlers may add or remove sources, so a copy of ready ones is used
+    ready = malloc(sizeof(event_source) * (count + 1));
+    for(i = 0, result = 0; i < count; i++){
+        if(fds[i+1].revents) ready[result++] = eventSources[i];
+    }
+    for(i = 0; i < result; i++) ready[i].handler(ready[i].fd, ready[i].data);
+    result = fds[0].revents != 0;
+    free(ready);
+    free(fds);
+    return result;
+}
+
+// Returns next byte from terminal, returns EOF when waiting interrupted by a signal or an event
+char readInput(){
+    if(inputPos < inputLength) return inputBuffer[inputPos++];
+    fflush(stdout);
+    if(state.replay) return replayInput();
+    if(processEvents(STDIN_FILENO, -1) <= 0) return EOF;
+    inputLength = read(STDIN_FILENO, inputBuffer, sizeof(inputBuffer));
+    inputPos = 0;
+    if(inputLength <= 0){
+        inputLength = 0;
+        return EOF;
+    }
+    if(state.recorder) recordEvent(RECORD_INPUT, (char*)inputBuffer, inputLength);
+    return inputBuffer[inputPos++];
+}
+
 void getCursorPosition(cursor_position *cp){
     char ch;
     cp->line=0;
     cp->column=0;
     printf("\e[6n");
-    while(getchar() != '\e');
-    getchar();
-    while((ch = getchar()) != ';') cp->line = (ch-48) + cp->line*10;
-    while((ch = getchar()) != 'R') cp->column = (ch-48) + cp->column*10;
+    fflush(stdout);
+    while(readInput() != '\e');
+    while(readInput() != '[');
+    while((ch = readInput()) != ';') if(isdigit(ch)) cp->line = (ch-48) + cp->line*10;
+    while((ch = readInput()) != 'R') if(isdigit(ch)) cp->column = (ch-48) + cp->column*10;
 }
 
 char* makeStr(char* string, int length){
@@ -151,16 +771,22 @@ void reloadTerminalWidth(){
     struct winsize w;
     int saveColumn;
     cursor_position cp;
+    if(state.replay){ // Size comes from log
+        updateCursorPos();
+        return;
+    }
     if (ioctl(STDOUT_FILENO, TIOCGWINSZ, &w) == -1 || w.ws_col == 0) {
         getCursorPosition(&cp);
         saveColumn = cp.column;
         printf("\e[999C");
         getCursorPosition(&cp);
         state.terminalWidth = cp.column;
+        state.terminalHeight = 24;
         printf("\e[%d;%dH", cp.line, saveColumn);
         DEBUG("reloadTerminalWidth: ioctl failed!\n");
     }else{
     state.terminalWidth = w.ws_col;
+    state.terminalHeight = w.ws_row ? w.ws_row : 24;
     }
     updateCursorPos();
 }
@@ -200,197 +826,942 @@ int getCharWidthAndSkip(char *string, int *i){
 }
 
 
-// Until we are able to maintain valid cursor position after any operation this is needed.
-void updateCursorPos(){
-    int line = state.startingColumn/state.terminalWidth; // Current line relative to beginning
-    int column = state.startingColumn %state.terminalWidth;
+// Walks content until offset and calculates line and column that offset would be printed at
+void getOffsetPosition(int offset, int *line, int *column){
     int i = 0;
-    char ch;
-    wchar_t wc;
     int width; //Width of char
-    while(i < state.curPos){
-        ch = state.content[i++];
-        width = 0; //getCharWidthAndSkip(state.content+i, &i);
-        if(ch & 0x80){ //Part of multi byte character
-            if(ch & 0x40){
-                //First byte of multi byte character
-                if(ch & 0x20){
-                    if(ch & 0x10){ // 4 btye
-                        wc = ((ch & 0x0F)<<18) + ((state.content[i++] & 0x3F)<<12) + ((state.content[i++] & 0x3F)<<6) + (state.content[i++] & 0x3F);
-                    }else{ // 3 byte
-                        wc = ((ch & 0x0F)<<12) + ((state.content[i++] & 0x3F)<<6) + (state.content[i++] & 0x3F);
-                    }
-                }else{
-                    // 2 byte
-                    wc = ((ch & 0x1F)<<6) + (state.content[i++] & 0x3F);
-                }
-                width = wcwidth(wc);
-                DEBUG("wc:%d, width:%d\n", wc, width);
-                if(width < 0) width = 0;
-            }else{
-                // Continuation byte
-                DEBUG("This should never happend 11!\n");
-            }
-        }else{
-            width = wcwidth(ch);
+    *line = state.startingColumn/state.terminalWidth; // Current line relative to beginning
+    *column = state.startingColumn %state.terminalWidth;
+    while(i < offset){
+        if(state.content[i] == '\n'){
+            i++;
+            (*line)++;
+            *column = 2;
+            continue;
         }
-        column += width;
-        if(column > state.terminalWidth){
-            line++;
-            if(column > state.terminalWidth) column = width;
-            else column = 0;
-        }else if(column == state.terminalWidth){
-            line++;
-            column = 0;
-        }
-        if(ch == '\n'){
-            line++;
-            column = 2;
+        width = getCharWidthAndSkip(state.content+i, &i);
+        *column += width;
+        if(*column > state.terminalWidth){
+            (*line)++;
+            *column = width;
+        }else if(*column == state.terminalWidth){
+            (*line)++;
+            *column = 0;
         }
     }
+}
+
+// Until we are able to maintain valid cursor position after any operation this is needed.
+void updateCursorPos(){
+    getOffsetPosition(state.curPos, &state.curLine, &state.curColumn);
+    state.posSync = 1;
+}
+
+// Moves terminal cursor to where given offset printed, does not change curPos
+void moveCursorTo(int offset){
+    int line, column;
+    if(!state.posSync) updateCursorPos();
+    getOffsetPosition(offset, &line, &column);
+    if(line < state.curLine) printf("\e[%dA", state.curLine - line);
+    else if(line > state.curLine) printf("\e[%dB", line - state.curLine);
+    if(column != state.curColumn){
+        printf("\r");
+        if(column > 0) printf("\e[%dC", column);
+    }
     state.curLine = line;
     state.curColumn = column;
-    state.posSync = 1;
 }
 
 //Just clears terminal does not change command in memory. printLine should be called after changes made in command
 void clearLine(){    
     if(!state.posSync) updateCursorPos();
     if(state.curLine > 0) printf("\e[%dA", state.curLine);  
-    printf("\e[999D\e[J\x1b[36m<%s>\x1b[0m ", state.cwd);
+    printf("\e[999D\e[J%s", state.prompt);
+    state.color = SYNTAX_ARGUMENT;
 }
 
-void updateCWD(){
+// Returns how many columns string takes in terminal
+int stringWidth(char *string){
     int i = 0;
-    int width = 3;
+    int width = 0;
+    while(string[i]) width += getCharWidthAndSkip(string+i, &i);
+    return width;
+}
+
+void promptStatusSegment(char *text){
+    text[0] = '\0';
+    if(state.lastStatus) sprintf(text, "✗%d", state.lastStatus);
+    if(state.lastDuration >= 1000){
+        sprintf(text + strlen(text), "%s%ld.%lds", state.lastStatus ? " " : "", state.lastDuration/1000, (state.lastDuration%1000)/100);
+    }
+}
+
+void promptLoadSegment(char *text){
+    FILE *file = fopen("/proc/loadavg", "r");
+    float load;
+    text[0] = '\0';
+    if(file == NULL) return;
+    if(fscanf(file, "%f", &load) == 1) sprintf(text, "load %.2f", load);
+    fclose(file);
+}
+
+// Runs in a child process since git status may take long in big repositories
+void promptGitSegment(char *text){
+    char line[PROMPT_SEGMENT_SIZE*2];
+    char skip[256];
+    char *branch, *end;
+    int dirty = 0;
+    FILE *git = popen("git status --porcelain -b 2>/dev/null", "r");
+    text[0] = '\0';
+    if(git == NULL) return;
+    if(fgets(line, sizeof(line), git) && strncmp(line, "## ", 3) == 0){
+        if(strchr(line, '\n') == NULL) while(fgets(skip, sizeof(skip), git) && strchr(skip, '\n') == NULL); // Rest of long first line
+        branch = line + 3;
+        if(strncmp(branch, "No commits yet on ", 18) == 0) branch += 18;
+        end = strstr(branch, "...");
+        if(end) *end = '\0';
+        branch[strcspn(branch, " \n")] = '\0';
+        dirty = fgets(skip, sizeof(skip), git) != NULL;
+        snprintf(text, PROMPT_SEGMENT_SIZE, "%.*s%s", PROMPT_SEGMENT_SIZE-2, branch, dirty ? "*" : "");
+    }
+    while(fgets(skip, sizeof(skip), git));
+    pclose(git);
+}
+
+prompt_segment promptSegments[] = {
+    {"git", promptGitSegment, "\e[35m", 1, 1, 1, 0, 0, ""},
+    {"status", promptStatusSegment, "\e[31m", 0, 0, 1, 0, 0, ""},
+    {"load", promptLoadSegment, "\e[33m", 0, 0, 0, 0, 0, ""},
+    {NULL}
+};
+
+// Builds prompt from cwd and cached texts of segments and updates startingColumn
+void promptBuild(){
+    int i;
+    int length = strlen(state.cwd) + 16;
+    int width = 3 + stringWidth(state.cwd); // Length of "<" cwd "> "
+    for(i = 0; promptSegments[i].name; i++) length += strlen(promptSegments[i].text) + 16;
+    free(state.prompt);
+    state.prompt = malloc(sizeof(char) * length);
+    length = sprintf(state.prompt, "\x1b[36m<%s>\x1b[0m", state.cwd);
+    for(i = 0; promptSegments[i].name; i++){
+        if(!promptSegments[i].enabled || !promptSegments[i].text[0]) continue;
+        length += sprintf(state.prompt + length, " %s%s\x1b[0m", promptSegments[i].color, promptSegments[i].text);
+        width += 1 + stringWidth(promptSegments[i].text);
+    }
+    sprintf(state.prompt + length, " ");
+    state.startingColumn = width;
+}
+
+// Called when an async segment's child writes its result
+void promptSegmentReady(int fd, void *data){
+    prompt_segment *segment = data;
+    char text[PROMPT_SEGMENT_SIZE];
+    int length = 0, result;
+    while(length < PROMPT_SEGMENT_SIZE-1 && (result = read(fd, text + length, PROMPT_SEGMENT_SIZE-1 - length)) > 0) length += result;
+    text[length] = '\0';
+    removeEventSource(fd);
+    close(fd);
+    segment->pending = 0;
+    if(segment->cwdDependent && segment->generation != state.cwdGeneration){ // Computed for previous directory
+        promptSegmentStart(segment);
+        return;
+    }
+    if(strcmp(text, segment->text) != 0){
+        strcpy(segment->text, text);
+        state.promptChanged = 1;
+    }
+}
+
+// Starts computation of segment in a grandchild so it is never mixed with children of commands while waiting
+void promptSegmentStart(prompt_segment *segment){
+    int fds[2];
+    pid_t pid;
+    if(pipe(fds) == -1) return;
+    fflush(stdout);
+    pid = fork();
+    if(pid == 0){
+        isChild = 1;
+        close(fds[0]);
+        if(fork() == 0){
+            segment->compute(segment->text);
+            write(fds[1], segment->text, strlen(segment->text));
+        }
+        _exit(0);
+    }
+    close(fds[1]);
+    if(pid < 0){
+        close(fds[0]);
+        return;
+    }
+    waitpid(pid, NULL, 0);
+    segment->pending = 1;
+    segment->generation = state.cwdGeneration;
+    addEventSource(fds[0], POLLIN, promptSegmentReady, segment);
+}
+
+// Updates segments before a new prompt is printed. Async ones keep showing cached text until they finish.
+void promptRefresh(){
+    int i;
+    for(i = 0; promptSegments[i].name; i++){
+        if(!promptSegments[i].enabled) continue;
+        if(!promptSegments[i].async) promptSegments[i].compute(promptSegments[i].text);
+        else if(!promptSegments[i].pending) promptSegmentStart(promptSegments + i);
+    }
+    promptBuild();
+    state.promptChanged = 0;
+}
+
+// Prints prompt again in place with the command after it
+void repaintPrompt(){
+    if(!state.posSync) updateCursorPos(); // Must be calculated with width of old prompt
+    promptBuild();
+    clearLine();
+    printLine();
+    state.promptChanged = 0;
+}
+
+void updateCWD(){
+    int i;
     if(state.cwd) free(state.cwd);
     state.cwd = getcwd(NULL,0);
-    while(state.cwd[i]) width += getCharWidthAndSkip(state.cwd, &i);
-    state.startingColumn = width;
+    state.cwdGeneration++;
+    for(i = 0; promptSegments[i].name; i++){
+        if(promptSegments[i].cwdDependent) promptSegments[i].text[0] = '\0';
+    }
+    promptBuild();
 }
 
-//Assumes clearLine run before this
-void printLine(){
+int builtinPrompt(char **args){
+    int i;
+    for(i = 0; promptSegments[i].name; i++){
+        if(args[1] == NULL){
+            printf("%s: %s\n\r", promptSegments[i].name, promptSegments[i].enabled ? "on" : "off");
+        }else if(strcmp(args[1], promptSegments[i].name) == 0){
+            promptSegments[i].enabled = args[2] == NULL || strcmp(args[2], "off") != 0;
+            return 0;
+        }
+    }
+    if(args[1] == NULL) return 0;
+    printf("Error: Unknown prompt segment %s!\n\r", args[1]);
+    return 1;
+}
+
+// Returns index of first token that ends after offset, tokenCount if there is none
+int syntaxTokenAt(int offset){
+    int low = 0, high = state.tokenCount;
+    while(low < high){
+        if(state.tokens[(low+high)/2].end <= offset) low = (low+high)/2 + 1;
+        else high = (low+high)/2;
+    }
+    return low;
+}
+
+// Switches terminal color to color of given token type if it is not active already
+void syntaxSetColor(char type){
+    #if SYNTAX_HIGHLIGHT
+        if(state.color == type) return;
+        if(state.color != SYNTAX_ARGUMENT) printf("\e[0m");
+        if(type != SYNTAX_ARGUMENT) printf("%s", syntaxColors[(int)type]);
+        state.color = type;
+    #endif
+}
+
+// Sets color for byte at offset, token is index of token that is at or after offset and advanced as offset passes tokens
+void syntaxColorAt(int offset, int *token){
+    while(*token < state.tokenCount && state.tokens[*token].end <= offset) (*token)++;
+    if(*token < state.tokenCount && state.tokens[*token].start <= offset) syntaxSetColor(state.tokens[*token].type);
+    else syntaxSetColor(SYNTAX_ARGUMENT);
+}
+
+// Prints content starting from offset. Cursor, curLine and curColumn has to be at position of offset
+void printContent(int offset){
     int i;
     int l;
     int width;
-    state.curLine = state.startingColumn/state.terminalWidth;
-    state.curColumn = state.startingColumn %state.terminalWidth;
-    if(state.length > 0){
-        for(i = 0; i < state.curPos;){ // Since we need column and line until curPos, this loop goes until curPos
-            l = i;
-            if( state.content[l] == '\n'){
-                state.curLine++;
-                i++;
-                state.curColumn = 2;
-                printf("\n\r> ");
-            }else{
-                width = getCharWidthAndSkip(state.content+i, &i);
-                while(l < i) putchar(state.content[l++]);
-                state.curColumn += width;
-                if(state.curColumn >= state.terminalWidth){
-                    if(state.curColumn == state.terminalWidth){
-                        state.curColumn = 0;
-                        state.curLine++;
-                        printf("a\e[D\e[K");
-                    }else{
-                        state.curColumn = width;
-                        state.curLine++;
-                    }
+    int token = syntaxTokenAt(offset);
+    for(i = offset; i < state.curPos;){ // Since we need column and line until curPos, this loop goes until curPos
+        l = i;
+        syntaxColorAt(i, &token);
+        if( state.content[l] == '\n'){
+            state.curLine++;
+            i++;
+            state.curColumn = 2;
+            syntaxSetColor(SYNTAX_ARGUMENT);
+            printf("\n\r> ");
+        }else{
+            width = getCharWidthAndSkip(state.content+i, &i);
+            while(l < i) putchar(state.content[l++]);
+            state.curColumn += width;
+            if(state.curColumn >= state.terminalWidth){
+                if(state.curColumn == state.terminalWidth){
+                    state.curColumn = 0;
+                    state.curLine++;
+                    printf("a\e[D\e[K");
+                }else{
+                    state.curColumn = width;
+                    state.curLine++;
                 }
             }
-
         }
+    }
 
-        if(i < state.length){ // If there is string after curPos
-            printf("\e7");
-            for(; i < state.length;i++){
-                putchar(state.content[i]);
-                if(state.content[i] == '\n') printf("\r> ");
-            }
-            if(state.curPos != state.length) printf("\e8");
+    if(i < state.length){ // If there is string after curPos
+        printf("\e7");
+        for(; i < state.length;i++){
+            syntaxColorAt(i, &token);
+            if(state.content[i] == '\n'){
+                syntaxSetColor(SYNTAX_ARGUMENT);
+                printf("\n\r> ");
+            }else putchar(state.content[i]);
         }
-
+        syntaxSetColor(SYNTAX_ARGUMENT);
+        printf("\e8");
+        #if SYNTAX_HIGHLIGHT
+            printf("\e[0m"); // Restoring cursor also restores color that was active while saving
+        #endif
     }
+    syntaxSetColor(SYNTAX_ARGUMENT);
     state.posSync = 1;
 }
 
+//Assumes clearLine run before this
+void printLine(){
+    state.curLine = state.startingColumn/state.terminalWidth;
+    state.curColumn = state.startingColumn %state.terminalWidth;
+    printContent(0);
+}
 
-void historyAdd(char *command){
-    history_record *record = malloc(sizeof(history_record));
-
-    if(state.history_last) state.history_last->newer = record;
-    record->command = command;
-    record->older = state.history_last;
-    record->newer = NULL;
-    state.history_last = record;
+// Reprints only the part of the command after offset. Content before offset must be unchanged since last print.
+void printLineFrom(int offset){
+    if(offset > state.curPos) offset = state.curPos;
+    moveCursorTo(offset);
+    printf("\e[J");
+    printContent(offset);
 }
 
-void loadFromHistory(history_record *record){
+// Returns length of valid variable name at start of string, 0 if it does not start with one
+int variableNameLength(char *string){
     int i = 0;
+    if(!isalpha(string[0]) && string[0] != '_') return 0;
+    while(isalnum(string[i]) || string[i] == '_') i++;
+    return i;
+}
 
-    if(state.length > 0){
-        if(state.history_pos == NULL){
-            state.draft = makeStr(state.content, state.length);
-            DEBUG("loadFromHistory: Content saved as draft. (%s) length: %d\n", state.draft, state.length);    
-        }
-        clearLine();
-    }
-    state.history_pos = record;
-    state.curColumn = 3;
-    state.curLine = 0;
-    state.length = 0;
-    state.curPos = 0;
-    while(record->command[i]){
-        addChar(record->command[i]);
-        i++;
-    }
-    state.posSync = 0;
-    DEBUG_DUMP_STATE("loadFromHistory_end");
+shell_variable** findVariable(char *name){
+    unsigned int hash = 0;
+    int i;
+    shell_variable **variable;
+    for(i = 0; name[i]; i++) hash = hash*31 + (unsigned char)name[i];
+    variable = &state.variables[hash % VARIABLE_TABLE_SIZE];
+    while(*variable && strcmp((*variable)->name, name) != 0) variable = &(*variable)->next;
+    return variable;
 }
 
-void loadPrevious(){
-    if(state.history_pos){
-        if(state.history_pos->older) loadFromHistory(state.history_pos->older);
-    }else if(state.history_last) loadFromHistory(state.history_last);
+// Returns value of variable or NULL if it is not set
+char* getVariable(char *name){
+    shell_variable *variable = *findVariable(name);
+    return variable ? variable->value : NULL;
 }
 
+void commandCacheClear();
 
-void loadNext(){
-    if(state.history_pos == NULL) return;
+// Sets value of variable, value may be NULL to only change exported. exported is -1 to keep it as it is.
+void setVariable(char *name, char *value, int exported){
+    shell_variable **slot = findVariable(name);
+    shell_variable *variable = *slot;
+    if(variable == NULL){
+        variable = malloc(sizeof(shell_variable));
+        variable->name = makeStr(name, strlen(name));
+        variable->value = makeStr("", 0);
+        variable->exported = 0;
+        variable->next = NULL;
+        *slot = variable;
+    }
+    if(value){
+        free(variable->value);
+        variable->value = makeStr(value, strlen(value));
+    }
+    if(exported >= 0 && variable->exported != exported){
+        variable->exported = exported;
+        state.envpValid = 0;
+    }
+    if(variable->exported && value) state.envpValid = 0;
+    if(strcmp(name, "PATH") == 0) commandCacheClear();
+}
+
+void unsetVariable(char *name){
+    shell_variable **slot = findVariable(name);
+    shell_variable *variable = *slot;
+    if(variable == NULL) return;
+    if(variable->exported) state.envpValid = 0;
+    if(strcmp(name, "PATH") == 0) commandCacheClear();
+    *slot = variable->next;
+    free(variable->name);
+    free(variable->value);
+    free(variable);
+}
+
+void freeEnvp(){
+    int i;
+    if(state.envp == NULL) return;
+    for(i = 0; state.envp[i]; i++) free(state.envp[i]);
+    free(state.envp);
+    state.envp = NULL;
+}
+
+// Returns environment for exec, it is built again only if an exported variable changed since last call
+char** getEnvp(){
+    int i, count = 0;
+    shell_variable *variable;
+    if(state.envpValid) return state.envp;
+    freeEnvp();
+    for(i = 0; i < VARIABLE_TABLE_SIZE; i++){
+        for(variable = state.variables[i]; variable; variable = variable->next){
+            if(!variable->exported) continue;
+            ADJUST_CAPACITY(state.envp, count, 0, sizeof(char*));
+            state.envp[count] = malloc(strlen(variable->name) + strlen(variable->value) + 2);
+            sprintf(state.envp[count++], "%s=%s", variable->name, variable->value);
+        }
+    }
+    ADJUST_CAPACITY(state.envp, count, 0, sizeof(char*));
+    state.envp[count] = NULL;
+    state.envpValid = 1;
+    return state.envp;
+}
+
+// Sets variable from NAME=value string
+void assignVariable(char *assignment, int exported){
+    int length = variableNameLength(assignment);
+    char *name = makeStr(assignment, length);
+    setVariable(name, assignment + length + 1, exported);
+    free(name);
+}
+
+// Assignments before a builtin or function that runs in shell are exported while it runs.
+// Returns previous values, newest first, to be given back to restoreTemporary.
+shell_variable* assignTemporary(char **args, char **command){
+    shell_variable *saved = NULL, *old, *copy;
+    for(; args < command; args += 2){
+        copy = malloc(sizeof(shell_variable));
+        copy->name = makeStr(args[1], variableNameLength(args[1]));
+        old = *findVariable(copy->name);
+        copy->value = old ? makeStr(old->value, strlen(old->value)) : NULL; // NULL if it was not set
+        copy->exported = old ? old->exported : 0;
+        copy->next = saved;
+        saved = copy;
+        assignVariable(args[1], 1);
+    }
+    return saved;
+}
+
+void restoreTemporary(shell_variable *saved){
+    shell_variable *next;
+    for(; saved; saved = next){
+        next = saved->next;
+        if(saved->value) setVariable(saved->name, saved->value, saved->exported);
+        else unsetVariable(saved->name);
+        free(saved->name);
+        free(saved->value);
+        free(saved);
+    }
+}
+
+void importEnvironment(){
+    int i;
+    for(i = 0; environ[i]; i++){
+        if(variableNameLength(environ[i]) && environ[i][variableNameLength(environ[i])] == '=') assignVariable(environ[i], 1);
+    }
+}
+
+void freeVariables(){
+    int i;
+    while(1){
+        for(i = 0; i < VARIABLE_TABLE_SIZE && state.variables[i] == NULL; i++);
+        if(i == VARIABLE_TABLE_SIZE) break;
+        unsetVariable(state.variables[i]->name);
+    }
+    freeEnvp();
+}
+
+shell_definition** findDefinition(shell_definition **table, char *name){
+    unsigned int hash = 0;
+    int i;
+    shell_definition **definition;
+    for(i = 0; name[i]; i++) hash = hash*31 + (unsigned char)name[i];
+    definition = &table[hash % DEFINITION_TABLE_SIZE];
+    while(*definition && strcmp((*definition)->name, name) != 0) definition = &(*definition)->next;
+    return definition;
+}
+
+// Returns whether a command with given name can be run. Results are cached until commandCacheClear called.
+int commandExists(char *name, int length){
+    unsigned int hash = 0;
+    int i;
+    char *path, *end;
+    char *file;
+    command_cache_entry *entry;
+    struct stat st;
+    if(memchr(name, '/', length)){ // Path is relative to cwd, so it is not cached
+        file = makeStr(name, length);
+        i = stat(file, &st) == 0 && S_ISREG(st.st_mode) && access(file, X_OK) == 0;
+        free(file);
+        return i;
+    }
+    for(i = 0; i < length; i++) hash = hash*31 + (unsigned char)name[i];
+    hash %= COMMAND_CACHE_SIZE;
+    for(entry = commandCache[hash]; entry; entry = entry->next){
+        if(strncmp(entry->name, name, length) == 0 && entry->name[length] == '\0') return entry->found;
+    }
+    entry = malloc(sizeof(command_cache_entry) + length + 1);
+    memcpy(entry->name, name, length);
+    entry->name[length] = '\0';
+    entry->found = 0;
+    entry->next = commandCache[hash];
+    commandCache[hash] = entry;
+    for(i = 0; builtins[i].name; i++){
+        if(strcmp(builtins[i].name, entry->name) == 0) entry->found = 1;
+    }
+    if(*findDefinition(state.aliases, entry->name) || *findDefinition(state.functions, entry->name)) entry->found = 1;
+    path = getVariable("PATH");
+    while(!entry->found && path && *path){
+        end = strchr(path, ':');
+        if(end == NULL) end = path + strlen(path);
+        file = malloc(end - path + length + 2);
+        memcpy(file, path, end - path);
+        file[end - path] = '/';
+        memcpy(file + (end - path) + 1, name, length);
+        file[end - path + length + 1] = '\0';
+        entry->found = stat(file, &st) == 0 && S_ISREG(st.st_mode) && access(file, X_OK) == 0;
+        free(file);
+        path = *end ? end + 1 : end;
+    }
+    return entry->found;
+}
+
+void commandCacheClear(){
+    int i;
+    command_cache_entry *entry;
+    for(i = 0; i < COMMAND_CACHE_SIZE; i++){
+        while(commandCache[i]){
+            entry = commandCache[i];
+            commandCache[i] = entry->next;
+            free(entry);
+        }
+    }
+}
+
+#define IS_SPACE(ch) ((ch) == ' ' || (ch) == '\t' || (ch) == '\n')
+#define IS_OPERATOR_CHAR(ch) ((ch) == '|' || (ch) == '&' || (ch) == ';' || (ch) == '<' || (ch) == '>')
+#define IS_WORD_TOKEN(type) ((type) <= SYNTAX_STRING || (type) == SYNTAX_ASSIGNMENT)
+
+// Lexes a single token starting at i which must not be a whitespace
+void lexToken(int i, char lexState, syntax_token *token){
+    char ch = state.content[i];
+    int end = i;
+    int l;
+    token->start = i;
+    token->lexState = lexState;
+    if(!(lexState & LEX_GLUED)) while(end < state.length && isdigit(state.content[end])) end++; // File descriptor of redirection
+    if(end < state.length && (state.content[end] == '<' || state.content[end] == '>')){
+        ch = state.content[end++];
+        if(end < state.length && (state.content[end] == ch || state.content[end] == '&' || state.content[end] == '|')) end++;
+        if(ch == '<' && end < state.length && state.content[end-1] == '<' && state.content[end] == '-') end++; // <<-
+        token->type = SYNTAX_REDIRECTION;
+    }else if(ch == '|' || ch == '&' || ch == ';'){
+        end = i+1;
+        if(ch != ';' && end < state.length && state.content[end] == ch) end++;
+        token->type = SYNTAX_OPERATOR;
+    }else if(ch == '\'' || ch == '\"'){
+        end = i+1;
+        while(end < state.length && state.content[end] != ch){
+            if(ch == '\"' && state.content[end] == '\\') end++;
+            end++;
+        }
+        if(end < state.length) end++; // Closing quote
+        token->type = SYNTAX_STRING;
+    }else{
+        end = i;
+        while(end < state.length && !IS_SPACE(state.content[end]) && !IS_OPERATOR_CHAR(state.content[end])
+            && state.content[end] != '\'' && state.content[end] != '\"'){
+            if(state.content[end] == '\\') end++;
+            end++;
+        }
+        if(end > state.length) end = state.length;
+        for(l = i; l < end && (isalnum(state.content[l]) || state.content[l] == '_'); l++);
+        if(end - i == 1 && (ch == '{' || ch == '}') && !(lexState & LEX_GLUED)) token->type = SYNTAX_OPERATOR; // Function body
+        else if(lexState & (LEX_GLUED | LEX_TARGET) || !(lexState & LEX_COMMAND)) token->type = SYNTAX_ARGUMENT;
+        else if(l > i && !isdigit(ch) && l < end && state.content[l] == '=') token->type = SYNTAX_ASSIGNMENT;
+        else if(l > i && !isdigit(ch) && l == end - 2 && state.content[l] == '(' && state.content[l+1] == ')') token->type = SYNTAX_COMMAND; // name()
+        else if(commandExists(state.content+i, (end > state.length ? state.length : end) - i)) token->type = SYNTAX_COMMAND;
+        else token->type = SYNTAX_MISSING;
+    }
+    if(end > state.length) end = state.length;
+    token->end = end;
+}
+
+// Returns the state of lexer after given token
+char lexNextState(syntax_token *token){
+    if(token->type == SYNTAX_OPERATOR) return LEX_COMMAND;
+    if(token->type == SYNTAX_REDIRECTION) return LEX_TARGET | (token->lexState & LEX_COMMAND);
+    if(token->type == SYNTAX_ASSIGNMENT) return token->lexState; // Command comes after assignments
+    if(token->lexState & LEX_GLUED) return token->lexState & ~LEX_GLUED;
+    if(token->lexState & LEX_TARGET) return token->lexState & ~LEX_TARGET;
+    return 0;
+}
+
+// Updates tokens after bytes between start and start+removed replaced with inserted bytes in content.
+// Lexing restarts from the word that edit touches and stops as soon as a token matches its old version.
+// Returns offset that terminal output became stale from, it is before start if color of an earlier token changed.
+int syntaxUpdate(int start, int removed, int inserted){
+    int delta = inserted - removed;
+    int i, j, k, m, o;
+    int n = 0; // Count of newly lexed tokens
+    int match = 0;
+    int repaint = start;
+    int prevEnd = -1, prevWord = 0;
+    char lexState;
+    syntax_token *new = malloc(sizeof(syntax_token) * CAPACIY_INCREMENT);
+    #if !SYNTAX_HIGHLIGHT
+        free(new);
+        return start;
+    #endif
+
+    // Find first token touched by edit and go back to start of its word
+    k = syntaxTokenAt(start-1);
+    while(k > 0 && k < state.tokenCount && (state.tokens[k].lexState & LEX_GLUED)) k--;
+    if(k < state.tokenCount && state.tokens[k].start <= start){
+        i = state.tokens[k].start;
+        lexState = state.tokens[k].lexState;
+    }else if(k > 0){
+        i = state.tokens[k-1].end;
+        prevEnd = i;
+        prevWord = IS_WORD_TOKEN(state.tokens[k-1].type);
+        lexState = lexNextState(&state.tokens[k-1]);
+    }else{
+        i = 0;
+        lexState = LEX_COMMAND;
+    }
+    j = k;
+    while(j < state.tokenCount && state.tokens[j].start < start + removed) j++;
+
+    while(1){
+        while(i < state.length && IS_SPACE(state.content[i])) i++;
+        if(i >= state.length) break;
+        ADJUST_CAPACITY(new, n, 0, sizeof(syntax_token));
+        if(prevWord && prevEnd == i && !IS_OPERATOR_CHAR(state.content[i])) lexToken(i, lexState | LEX_GLUED, new+n);
+        else lexToken(i, lexState, new+n);
+        // Tokens after edit that lexed same as before means rest of tokens are still valid
+        while(j < state.tokenCount && state.tokens[j].start + delta < new[n].start) j++;
+        if(new[n].start >= start + inserted && j < state.tokenCount && state.tokens[j].start + delta == new[n].start
+            && state.tokens[j].end + delta == new[n].end && state.tokens[j].type == new[n].type
+            && state.tokens[j].lexState == new[n].lexState){
+            match = 1;
+            break;
+        }
+        lexState = lexNextState(new+n);
+        prevEnd = i = new[n].end;
+        prevWord = IS_WORD_TOKEN(new[n].type);
+        n++;
+    }
+    if(!match) j = state.tokenCount;
+
+    // Tokens before edit are already printed, if their color changed they have to be printed again
+    for(o = 0; o < n && new[o].start < start; o++){
+        for(m = k; m < state.tokenCount && state.tokens[m].start < new[o].start; m++);
+        if(m >= state.tokenCount || state.tokens[m].start != new[o].start || state.tokens[m].type != new[o].type){
+            if(new[o].start < repaint) repaint = new[o].start;
+        }
+    }
+
+    m = state.tokenCount - (j - k) + n; // New token count
+    if(m > state.tokenCapacity){
+        state.tokenCapacity = m + CAPACIY_INCREMENT;
+        state.tokens = realloc(state.tokens, sizeof(syntax_token) * state.tokenCapacity);
+    }
+    memmove(state.tokens + k + n, state.tokens + j, sizeof(syntax_token) * (state.tokenCount - j));
+    memcpy(state.tokens + k, new, sizeof(syntax_token) * n);
+    for(o = k + n; o < m; o++){
+        state.tokens[o].start += delta;
+        state.tokens[o].end += delta;
+    }
+    state.tokenCount = m;
+    free(new);
+    return repaint;
+}
+
+// Lexes whole content again, needed when content is replaced at once
+void syntaxRebuild(){
+    state.tokenCount = 0;
+    syntaxUpdate(0, 0, state.length);
+}
+
+output_capture* captureCreate(){
+    output_capture *capture = malloc(sizeof(output_capture));
+    capture->first = NULL;
+    capture->last = NULL;
+    capture->size = 0;
+    capture->dropped = 0;
+    return capture;
+}
+
+// Gives back chunk's memory or its slot in spill file
+void captureChunkFree(capture_chunk *chunk){
+    if(chunk->data){
+        state.captureMemory -= CAPTURE_CHUNK_SIZE;
+        free(chunk->data);
+    }else{
+        ADJUST_CAPACITY(state.spillFree, state.spillFreeCount, 0, sizeof(long));
+        state.spillFree[state.spillFreeCount++] = chunk->offset;
+        state.spillUsed -= CAPTURE_CHUNK_SIZE;
+        if(state.spillUsed == 0 && ftruncate(fileno(state.spillFile), 0) == 0){ // Nothing is spilled anymore, file is emptied
+            state.spillSize = 0;
+            state.spillFreeCount = 0;
+        }
+    }
+    free(chunk);
+}
+
+void captureFree(output_capture *capture){
+    capture_chunk *chunk;
+    if(capture == NULL) return;
+    while(capture->first){
+        chunk = capture->first;
+        capture->first = chunk->next;
+        captureChunkFree(chunk);
+    }
+    free(capture);
+}
+
+// Drops first chunk of oldest capture that starts with a spilled chunk, returns 0 if there is none
+int captureDropSpilled(){
+    history_record *record = state.history_last;
+    output_capture *capture;
+    capture_chunk *chunk;
+    while(record && record->older) record = record->older;
+    for(; record; record = record->newer){
+        capture = record->output;
+        if(capture == NULL || capture->first == NULL || capture->first->data) continue;
+        chunk = capture->first;
+        capture->first = chunk->next;
+        if(capture->first == NULL) capture->last = NULL;
+        capture->size -= chunk->length;
+        capture->dropped += chunk->length;
+        captureChunkFree(chunk);
+        return 1;
+    }
+    return 0;
+}
+
+// Returns offset of a free slot in spill file, oldest spilled output is dropped when file reached its limit
+long captureSpillSlot(){
+    long offset;
+    while(state.spillFreeCount == 0 && state.spillSize + CAPTURE_CHUNK_SIZE > CAPTURE_SPILL_LIMIT){
+        if(!captureDropSpilled()) return -1;
+    }
+    if(state.spillFreeCount) return state.spillFree[--state.spillFreeCount];
+    offset = state.spillSize;
+    state.spillSize += CAPTURE_CHUNK_SIZE;
+    return offset;
+}
+
+// Moves oldest chunks in memory to spill file until captures fit in memory limit
+void captureSpill(){
+    history_record *record = state.history_last;
+    capture_chunk *chunk;
+    long offset;
+    if(state.spillFile == NULL) state.spillFile = tmpfile();
+    if(state.spillFile == NULL) return;
+    while(record && record->older) record = record->older;
+    for(; record && state.captureMemory > CAPTURE_MEMORY_LIMIT; record = record->newer){
+        if(record->output == NULL) continue;
+        for(chunk = record->output->first; chunk && state.captureMemory > CAPTURE_MEMORY_LIMIT; chunk = chunk->next){
+            if(chunk->data == NULL || (state.capture && chunk == state.capture->last)) continue; // Running command still writes it
+            offset = captureSpillSlot();
+            if(offset < 0) return;
+            if(fseek(state.spillFile, offset, SEEK_SET) != 0 || fwrite(chunk->data, 1, chunk->length, state.spillFile) != (size_t)chunk->length){
+                ADJUST_CAPACITY(state.spillFree, state.spillFreeCount, 0, sizeof(long));
+                state.spillFree[state.spillFreeCount++] = offset;
+                return;
+            }
+            chunk->offset = offset;
+            state.spillUsed += CAPTURE_CHUNK_SIZE;
+            free(chunk->data);
+            chunk->data = NULL;
+            state.captureMemory -= CAPTURE_CHUNK_SIZE;
+        }
+    }
+    fflush(state.spillFile);
+}
+
+void captureWrite(output_capture *capture, char *data, long length){
+    capture_chunk *chunk;
+    long part;
+    while(length > 0){
+        if(capture->last == NULL || capture->last->length == CAPTURE_CHUNK_SIZE){
+            chunk = malloc(sizeof(capture_chunk));
+            chunk->data = malloc(CAPTURE_CHUNK_SIZE);
+            chunk->length = 0;
+            chunk->next = NULL;
+            if(capture->last) capture->last->next = chunk;
+            else capture->first = chunk;
+            capture->last = chunk;
+            state.captureMemory += CAPTURE_CHUNK_SIZE;
+        }
+        part = CAPTURE_CHUNK_SIZE - capture->last->length;
+        if(part > length) part = length;
+        memcpy(capture->last->data + capture->last->length, data, part);
+        capture->last->length += part;
+        capture->size += part;
+        data += part;
+        length -= part;
+        // Keep only last captureLimit bytes
+        while(capture->first != capture->last && capture->size - capture->first->length >= state.captureLimit){
+            chunk = capture->first;
+            capture->first = chunk->next;
+            capture->size -= chunk->length;
+            capture->dropped += chunk->length;
+            captureChunkFree(chunk);
+        }
+    }
+    if(state.captureMemory > CAPTURE_MEMORY_LIMIT) captureSpill();
+}
+
+// Calls handler with each piece of captured output in order, returns 0 if a spilled chunk could not be read
+int captureRead(output_capture *capture, void (*handler)(char *data, int length, void *context), void *context){
+    capture_chunk *chunk;
+    char *buffer = NULL;
+    for(chunk = capture->first; chunk; chunk = chunk->next){
+        if(chunk->data){
+            handler(chunk->data, chunk->length, context);
+            continue;
+        }
+        if(buffer == NULL) buffer = malloc(CAPTURE_CHUNK_SIZE);
+        if(fseek(state.spillFile, chunk->offset, SEEK_SET) != 0 || fread(buffer, 1, chunk->length, state.spillFile) != (size_t)chunk->length){
+            printf("Error: Could not read spilled output!\n");
+            free(buffer);
+            return 0;
+        }
+        handler(buffer, chunk->length, context);
+    }
+    free(buffer);
+    return 1;
+}
+
+void historyAdd(char *command){
+    history_record *record = malloc(sizeof(history_record));
+
+    if(state.history_last) state.history_last->newer = record;
+    record->command = command;
+    record->number = state.history_last ? state.history_last->number + 1 : 1;
+    record->output = NULL;
+    record->older = state.history_last;
+    record->newer = NULL;
+    state.history_last = record;
+}
+
+void loadFromHistory(history_record *record){
+    int length = strlen(record->command);
+    editLogClear();
+
+    if(state.length > 0){
+        if(state.history_pos == NULL){
+            state.draft = makeStr(state.content, state.length);
+            DEBUG("loadFromHistory: Content saved as draft. (%s) length: %d\n", state.draft, state.length);    
+        }
+        clearLine();
+    }
+    state.history_pos = record;
+    if(length + 4 > state.capacity){
+        state.capacity = length + CAPACIY_INCREMENT;
+        state.content = realloc(state.content, sizeof(char) * state.capacity);
+    }
+    memcpy(state.content, record->command, length);
+    state.length = length;
+    state.curPos = length;
+    syntaxRebuild();
+    printLine();
+    DEBUG_DUMP_STATE("loadFromHistory_end");
+}
+
+void loadPrevious(){
+    if(state.history_pos){
+        if(state.history_pos->older) loadFromHistory(state.history_pos->older);
+    }else if(state.history_last) loadFromHistory(state.history_last);
+}
+
+
+void loadNext(){
+    if(state.history_pos == NULL) return;
     if(state.history_pos->newer){
         loadFromHistory(state.history_pos->newer);
     }else{
         // Load draft if there is one
+        editLogClear();
         if(state.length > 0) clearLine();
         if(state.draft){
             DEBUG("loadNext: Loading the draft.\n");
             if(state.content) free(state.content);
             state.content = state.draft;
             state.draft = 0;
-            state.curPos = printf("%s", state.content);
+            state.curPos = strlen(state.content);
             state.capacity = state.curPos;
             state.length = state.curPos;
+            syntaxRebuild();
+            printLine();
         }else{
             state.length = 0;
             state.curPos = 0;
+            state.tokenCount = 0;
         }
         state.history_pos = NULL;
         state.posSync = 0;
     }
 }
 
+// Prints the char that ends at curPos just after it is appended to end of the content
+void printAppended(int start){
+    int i;
+    int width = 0;
+    int repaint = syntaxUpdate(start, 0, state.curPos - start);
+    if(repaint < start){ // Color of the word changed, e.g. it became a known command
+        printLineFrom(repaint);
+        return;
+    }
+    syntaxSetColor(state.tokenCount && state.tokens[state.tokenCount-1].end == state.curPos && state.content[start] != '\n' ?
+        state.tokens[state.tokenCount-1].type : SYNTAX_ARGUMENT);
+    i = start;
+    if(state.content[start] != '\n') width = getCharWidthAndSkip(state.content+start, &i);
+    for(i = start; i < state.curPos; i++) putchar(state.content[i]);
+    syntaxSetColor(SYNTAX_ARGUMENT);
+
+    if(width > 0){
+        state.curColumn += width;
+        if(state.curColumn == state.terminalWidth){
+            state.curColumn = 0;
+            state.curLine++;
+            printf("a\e[D\e[K");
+        }else if(state.curColumn > state.terminalWidth){
+            state.curColumn = width;
+            state.curLine++;
+        }
+    }else if(state.content[start] == '\n'){
+        state.curLine++;
+        state.curColumn = 2;
+        printf("\r> ");
+    }
+}
+
 //adds a char that starts at where curPos points
 void addChar(char ch){
-    wchar_t wideChar;
     int i;
     int l;
-    int width = 0;
     int continuationByte = 0;
     if(state.length+4 > state.capacity){ //We may open space in the middle of string for multi byte sequence therefore length+3
         state.capacity += CAPACIY_INCREMENT;
         state.content = realloc(state.content, sizeof(char) * state.capacity );
     }
+    if(!state.posSync) updateCursorPos();
 
     if(ch & 0x80){
         if(ch & 0x40){
@@ -402,29 +1773,23 @@ void addChar(char ch){
             if(ch & 0x20){
                 if(ch & 0x10){ // 4 btye
                     state.expectedBytes = 3;
-                    state.wideChar = (ch & 0x0F)<<18;
                 }else{ // 3 byte
                     state.expectedBytes = 2;
-                    state.wideChar = (ch & 0x0F)<<12;
                 }
             }else{
                 // 2 byte
                 state.expectedBytes = 1;
-                state.wideChar = (ch & 0x1F)<<6;
             }
         }else{
             // Continuation byte
             continuationByte = 1;
-            state.wideChar += (ch & 0x3F)<<(--state.expectedBytes*6);
-            if(state.expectedBytes == 0){ //Multi byte sequence completed!
-                width = wcwidth(state.wideChar);
-            }
+            state.expectedBytes--;
         }
     }else{ //Single byte
         #if DEBUG_ENABLED
             if(state.expectedBytes > 0) DEBUG("This should never ever happen! addChar: expected char didn't received!\n");
         #endif
-        width = wcwidth(ch);
+        state.lastCharStart = state.curPos;
     }
 
     DEBUG_DUMP_STATE("addChar before if");
@@ -432,46 +1797,25 @@ void addChar(char ch){
         state.content[state.curPos] = ch;
         state.curPos++;
         state.length++;
-        putchar(ch);
-
-        if(width > 0){
-            state.curColumn += width;
-            if(state.curColumn == state.terminalWidth){
-                state.curColumn = 0;
-                state.curLine++;
-                printf("a\e[D\e[K");
-            }else if(state.curColumn > state.terminalWidth){
-                state.curColumn = width;
-                state.curLine++;
-            }
-        }else if(ch == '\n'){
-            state.curLine++;
-            state.curColumn = 2;
-            printf("\r> ");
-        }
+        // Multi byte chars are printed once all bytes received, so their color is known
+        if(state.expectedBytes == 0) printAppended(state.lastCharStart);
     }else{
         //DEBUG("addChar curPos != length");
-        if(continuationByte){
-            state.content[state.curPos] = ch;
-            state.curPos++;
-            state.length++;
-            if(state.expectedBytes == 0){
-                printLine();
-            }
-        }else{
-            clearLine(&state);
+        if(!continuationByte){
             l = 1 + state.expectedBytes;
             for(i=state.length-1; i >= state.curPos; i--){
                 state.content[i+l] = state.content[i];
             }
-            state.content[state.curPos] = ch;
-            state.curPos++;
-            state.length++;
-            if(state.expectedBytes == 0){
-                printLine();
-            }
+        }
+        state.content[state.curPos] = ch;
+        state.curPos++;
+        state.length++;
+        if(state.expectedBytes == 0){
+            // Only the touched word and the text after it needs to be printed again
+            printLineFrom(syntaxUpdate(state.lastCharStart, 0, state.curPos - state.lastCharStart));
         }
     }
+    if(state.expectedBytes == 0) editLogRecord(state.lastCharStart, NULL, 0, state.content + state.lastCharStart, state.curPos - state.lastCharStart, 1);
 }
 
 // When curser is over a multibyte utf8 char curPos will point first char of that
@@ -480,341 +1824,3348 @@ void addChar(char ch){
 void moveBackward(){
     if(state.curPos > 0){
         DEBUG_DUMP_STATE("moveBackward start");
-        clearLine();
         while((state.content[--state.curPos] & 0xC0) == 0x80);
-        printLine();
+        moveCursorTo(state.curPos);
         DEBUG_DUMP_STATE("moveBackward end");
     }
 }
 
 void moveForward(){
     if(state.curPos < state.length){
-        clearLine();
         state.curPos++;
         while((state.content[state.curPos] & 0xC0) == 0x80) state.curPos++;
-        printLine();
+        moveCursorTo(state.curPos);
     }
 }
 
 // moves curser to end
 void goToEnd(){
     if(state.curPos < state.length){
-        clearLine();
         state.curPos = state.length;
-        printLine();
+        moveCursorTo(state.curPos);
+    }
+
+}
+
+
+void backspace(){
+    int i, j, x;
+    if(state.curPos > 0){
+        if(!state.posSync) updateCursorPos();
+        x = 1;
+        i = state.length - state.curPos;
+        state.curPos--;
+        while((state.content[state.curPos] & 0xC0) == 0x80){
+            state.curPos--;
+            x++;
+        }
+        state.length -= x;
+        editLogRecord(state.curPos, state.content + state.curPos, x, NULL, 0, 0);
+        
+        for(j = 0; j < i ; j++){
+            DEBUG("Copying: %X from %d to %d\n", HEXCHAR(state.content[state.curPos+j+x]), (state.curPos)+j+x, (state.curPos)+j);
+            state.content[state.curPos+j] = state.content[state.curPos+j+x];
+        }
+        DEBUG_DUMP_STATE("Backspace end");
+        printLineFrom(syntaxUpdate(state.curPos, x, 0));
+    }
+}
+
+void delete(){
+    int i, j, x;
+    if(state.curPos < state.length){
+        if(!state.posSync) updateCursorPos();
+        x = 0;
+        getCharWidthAndSkip(state.content+state.curPos, &x);
+        editLogRecord(state.curPos, state.content + state.curPos, x, NULL, 0, 0);
+        
+        i = state.length - state.curPos;
+        for(j = 0; j < i ; j++){
+            state.content[state.curPos+j] = state.content[state.curPos+j+x];
+        }
+        state.length -= x;
+        printLineFrom(syntaxUpdate(state.curPos, x, 0));
+    }
+}
+
+// Line is replaced or committed, its edits can not be undone anymore
+void editLogClear(){
+    state.edits.length = state.edits.position = 0;
+    state.edits.coalesce = 0;
+}
+
+// Makes room for more bytes of records, returns 0 if they would exceed limit
+int editLogReserve(long needed){
+    edit_log *log = &state.edits;
+    if(log->length + needed > EDIT_LOG_LIMIT) return 0;
+    if(log->length + needed > log->capacity){
+        log->capacity = log->capacity * 2 + needed < EDIT_LOG_LIMIT ? log->capacity * 2 + needed : EDIT_LOG_LIMIT;
+        log->data = realloc(log->data, log->capacity);
+    }
+    return 1;
+}
+
+// Adds record of an edit that is about to be applied, typed text is joined to previous typed text until a space
+void editLogRecord(int offset, char *removed, int removedLength, char *inserted, int insertedLength, int typed){
+    edit_log *log = &state.edits;
+    edit_header header;
+    long size = sizeof(edit_header) + removedLength + insertedLength + sizeof(long), last;
+    log->length = log->position;
+    if(typed && log->coalesce && removedLength == 0){
+        memcpy(&last, log->data + log->length - sizeof(long), sizeof(long));
+        memcpy(&header, log->data + log->length - last, sizeof(edit_header));
+        if(header.offset + header.inserted == offset && editLogReserve(insertedLength)){
+            header.inserted += insertedLength;
+            memcpy(log->data + log->length - last, &header, sizeof(edit_header));
+            memcpy(log->data + log->length - sizeof(long), inserted, insertedLength);
+            last += insertedLength;
+            log->length += insertedLength;
+            memcpy(log->data + log->length - sizeof(long), &last, sizeof(long));
+            log->position = log->length;
+            log->coalesce = !IS_SPACE(*inserted);
+            return;
+        }
+    }
+    if(size > EDIT_LOG_LIMIT){ // Edit too big to keep, earlier ones can not be undone over it
+        editLogClear();
+        return;
+    }
+    for(last = 0; log->length - last + size > EDIT_LOG_LIMIT; last += sizeof(edit_header) + header.removed + header.inserted + sizeof(long))
+        memcpy(&header, log->data + last, sizeof(edit_header));
+    if(last){ // Oldest records are dropped
+        memmove(log->data, log->data + last, log->length - last);
+        log->length -= last;
+    }
+    editLogReserve(size);
+    header.offset = offset;
+    header.removed = removedLength;
+    header.inserted = insertedLength;
+    memcpy(log->data + log->length, &header, sizeof(edit_header));
+    if(removedLength) memcpy(log->data + log->length + sizeof(edit_header), removed, removedLength);
+    if(insertedLength) memcpy(log->data + log->length + sizeof(edit_header) + removedLength, inserted, insertedLength);
+    memcpy(log->data + log->length + size - sizeof(long), &size, sizeof(long));
+    log->position = log->length += size;
+    log->coalesce = typed && !IS_SPACE(*inserted);
+}
+
+// Replaces removed bytes at start with text and moves cursor to given offset, line is printed once from first changed token
+void editReplace(int start, int removed, char *text, int inserted, int cursor){
+    if(state.length - removed + inserted + 4 > state.capacity){
+        state.capacity = state.length - removed + inserted + CAPACIY_INCREMENT;
+        state.content = realloc(state.content, sizeof(char) * state.capacity);
+    }
+    if(!state.posSync) updateCursorPos(); // Terminal cursor is still where old content put it
+    memmove(state.content + start + inserted, state.content + start + removed, state.length - start - removed);
+    if(inserted) memcpy(state.content + start, text, inserted);
+    state.length += inserted - removed;
+    state.curPos = cursor;
+    printLineFrom(syntaxUpdate(start, removed, inserted));
+}
+
+void undo(){
+    edit_log *log = &state.edits;
+    edit_header header;
+    long size;
+    char *record;
+    if(log->position == 0) return;
+    memcpy(&size, log->data + log->position - sizeof(long), sizeof(long));
+    record = log->data + log->position - size;
+    memcpy(&header, record, sizeof(edit_header));
+    log->position -= size;
+    log->coalesce = 0;
+    editReplace(header.offset, header.inserted, record + sizeof(edit_header), header.removed, header.offset + header.removed);
+}
+
+void redo(){
+    edit_log *log = &state.edits;
+    edit_header header;
+    char *record = log->data + log->position;
+    if(log->position == log->length) return;
+    memcpy(&header, record, sizeof(edit_header));
+    log->position += sizeof(edit_header) + header.removed + header.inserted + sizeof(long);
+    editReplace(header.offset, header.removed, record + sizeof(edit_header) + header.removed, header.inserted, header.offset + header.inserted);
+}
+
+// Removes text between start and end into kill ring, consecutive kills are joined in one entry
+void killRange(int start, int end, int prepend){
+    int length = end - start, oldLength;
+    char *old = state.killRing[state.killTop], *joined;
+    if(length <= 0) return;
+    if(state.lastAction == ACTION_KILL && old){
+        oldLength = strlen(old);
+        joined = malloc(oldLength + length + 1);
+        memcpy(joined + (prepend ? length : 0), old, oldLength);
+        memcpy(joined + (prepend ? 0 : oldLength), state.content + start, length);
+        joined[oldLength + length] = '\0';
+        free(old);
+        state.killRing[state.killTop] = joined;
+    }else{
+        state.killTop = (state.killTop + 1) % KILL_RING_SIZE;
+        free(state.killRing[state.killTop]);
+        state.killRing[state.killTop] = makeStr(state.content + start, length);
+    }
+    editLogRecord(start, state.content + start, length, NULL, 0, 0);
+    editReplace(start, length, NULL, 0, start);
+    state.action = ACTION_KILL;
+}
+
+int isWordByte(char ch){
+    return isalnum((unsigned char)ch) || (ch & 0x80) || ch == '_';
+}
+
+// Ctrl-W kills back to whitespace like other shells, Alt-Backspace only to start of alphanumeric word
+void killPreviousWord(int toSpace){
+    int i = state.curPos;
+    while(i > 0 && (toSpace ? IS_SPACE(state.content[i-1]) : !isWordByte(state.content[i-1]))) i--;
+    while(i > 0 && (toSpace ? !IS_SPACE(state.content[i-1]) : isWordByte(state.content[i-1]))) i--;
+    killRange(i, state.curPos, 1);
+}
+
+void killNextWord(){
+    int i = state.curPos;
+    while(i < state.length && !isWordByte(state.content[i])) i++;
+    while(i < state.length && isWordByte(state.content[i])) i++;
+    killRange(state.curPos, i, 0);
+}
+
+// Inserts kill ring entry at start in place of removed bytes, which are last yanked text when Alt-Y rotates
+void yankEntry(int index, int start, int removed){
+    char *text = state.killRing[index];
+    int length = strlen(text);
+    editLogRecord(start, state.content + start, removed, text, length, 0);
+    editReplace(start, removed, text, length, start + length);
+    state.yankStart = start;
+    state.yankLength = length;
+    state.yankIndex = index;
+    state.action = ACTION_YANK;
+}
+
+void yank(){
+    if(state.killRing[state.killTop]) yankEntry(state.killTop, state.curPos, 0);
+}
+
+void yankRotate(){
+    int index = state.yankIndex, i;
+    if(state.lastAction != ACTION_YANK) return;
+    for(i = 0; i < KILL_RING_SIZE; i++){
+        index = (index + KILL_RING_SIZE - 1) % KILL_RING_SIZE;
+        if(state.killRing[index]) break;
+    }
+    yankEntry(index, state.yankStart, state.yankLength);
+}
+
+void commit(){
+    editLogClear();
+    if(state.length > 0){
+        goToEnd();
+        printf("\n\r");
+        if(state.capacity == state.length || state.capacity/state.length > 1.04){
+            fflush(stdout);
+            state.content = realloc(state.content, sizeof(char) * (state.length+1));
+        }
+        state.content[state.length] = '\0';
+        historyAdd(state.content);
+        if(state.captureLimit) state.capture = state.history_last->output = captureCreate();
+        if(state.recorder) recordEvent(RECORD_COMMAND, state.content, state.length);
+        runCommand(state.content);
+        recordStatus();
+        if(state.capture && state.capture->size == 0){
+            captureFree(state.capture);
+            state.history_last->output = NULL;
+        }
+        state.capture = NULL;
+        state.content = malloc(sizeof(char) * CAPACIY_INCREMENT);
+        state.length = 0;
+        state.capacity = CAPACIY_INCREMENT;
+        state.curPos = 0;
+        state.tokenCount = 0;
+        commandCacheClear(); // Command may have installed or removed programs
+    }else{
+        state.curPos = 0;
+    }
+    state.history_pos = 0;
+}
+
+void freeCommandList(command_list *list){
+    int i, j;
+    if(list == NULL) return;
+    for(i = 0; i < list->count; i++){
+        for(j = 0; j < list->tokens[i].partCount; j++){
+            free(list->tokens[i].parts[j].text);
+            freeCommandList(list->tokens[i].parts[j].list);
+        }
+        free(list->tokens[i].parts);
+        freeCommandList(list->tokens[i].body);
+    }
+    free(list->tokens);
+    free(list);
+}
+
+void freeArgs(char **args){
+    int i;
+    if(args == NULL) return;
+    for(i = 0; args[i]; i++) if(args[i] != pipeMarker && args[i] != assignMarker && args[i] != heredocMarker) free(args[i]);
+    free(args);
+}
+
+// Reads delimiter of here-document starting at i, quotes are removed from it. Returns index after it.
+int heredocDelimiter(char *text, int i, char **delimiter, char *quoted){
+    char *word = malloc(strlen(text + i) + 1);
+    int length = 0;
+    char quote;
+    *quoted = 0;
+    while(text[i] == ' ' || text[i] == '\t') i++;
+    while(text[i] && !IS_SPACE(text[i]) && !IS_OPERATOR_CHAR(text[i])){
+        if(text[i] == '\'' || text[i] == '\"'){
+            quote = text[i++];
+            while(text[i] && text[i] != quote) word[length++] = text[i++];
+            if(text[i]) i++;
+            *quoted = 1;
+        }else if(text[i] == '\\' && text[i+1]){
+            word[length++] = text[i+1];
+            i += 2;
+            *quoted = 1;
+        }else{
+            word[length++] = text[i++];
+        }
+    }
+    word[length] = '\0';
+    *delimiter = word;
+    return i;
+}
+
+// Finds line that consists of delimiter starting from i. Returns index of its start, which is end of body,
+// and sets next to index after it. Returns -1 if there is no such line.
+int heredocFind(char *text, int i, char *delimiter, char strip, int *next){
+    int end, line, length = strlen(delimiter);
+    for(; ; i = end + 1){
+        for(end = i; text[end] && text[end] != '\n'; end++);
+        for(line = i; strip && text[line] == '\t'; line++);
+        if(end - line == length && strncmp(text + line, delimiter, length) == 0){
+            *next = text[end] ? end + 1 : end;
+            return i;
+        }
+        if(text[end] == '\0') return -1;
+    }
+}
+
+command_token* parserAddToken(command_parser *p, char type){
+    command_token *token;
+    ADJUST_CAPACITY(p->list->tokens, p->list->count, 0, sizeof(command_token));
+    token = p->list->tokens + p->list->count++;
+    token->type = type;
+    token->parts = NULL;
+    token->partCount = 0;
+    token->body = NULL;
+    return token;
+}
+
+word_part* parserAddPart(command_parser *p, char type, char quoted){
+    word_part *part;
+    if(p->word == NULL) p->word = parserAddToken(p, TOKEN_WORD);
+    ADJUST_CAPACITY(p->word->parts, p->word->partCount, 0, sizeof(word_part));
+    part = p->word->parts + p->word->partCount++;
+    part->type = type;
+    part->quoted = quoted;
+    part->text = NULL;
+    part->list = NULL;
+    return part;
+}
+
+// Turns collected literal text into a part
+void parserFlush(command_parser *p){
+    if(p->literalLength == 0) return;
+    parserAddPart(p, PART_LITERAL, p->literalQuoted)->text = makeStr(p->literal, p->literalLength);
+    p->literalLength = 0;
+}
+
+void parserAppend(command_parser *p, char ch, char quoted){
+    if(p->word == NULL) p->word = parserAddToken(p, TOKEN_WORD);
+    if(p->literalLength > 0 && p->literalQuoted != quoted) parserFlush(p);
+    if(p->literalLength + 1 > p->literalCapacity){
+        p->literalCapacity = p->literalCapacity * 2 + CAPACIY_INCREMENT;
+        p->literal = realloc(p->literal, p->literalCapacity);
+    }
+    p->literal[p->literalLength++] = ch;
+    p->literalQuoted = quoted;
+}
+
+void parserEndWord(command_parser *p){
+    int previous = p->list->count - 2;
+    word_part *first;
+    parserFlush(p);
+    if(p->word == NULL) return;
+    // Word that has no parts consists of empty quotes
+    if(p->word->partCount == 0) parserAddPart(p, PART_LITERAL, 1)->text = makeStr("", 0);
+    // Words like NAME=value before command are assignments
+    first = p->word->parts;
+    if((previous < 0 || IS_COMMAND_BOUNDARY(p->list->tokens[previous].type)) && first->type == PART_LITERAL && !first->quoted
+        && variableNameLength(first->text) && first->text[variableNameLength(first->text)] == '='){
+        p->word->type = TOKEN_ASSIGNMENT;
+    }
+    p->word = NULL;
+}
+
+// Parses $NAME, ${NAME}, $1, $#, $@, $? or $$ at current position, returns 0 if $ is not followed by a variable
+int parseVariable(command_parser *p, char quoted){
+    char *text = p->text + p->i + 1;
+    char *name;
+    int length;
+    if(*text == '{'){
+        length = variableNameLength(text + 1);
+        if(length == 0) while(isdigit(text[length + 1])) length++;
+        if(length == 0 && text[1] && strchr("?$#@", text[1])) length = 1;
+        if(length == 0 || text[length + 1] != '}'){
+            p->error = "Bad substitution";
+            return 1;
+        }
+        name = makeStr(text + 1, length);
+        p->i += length + 3;
+    }else if(isdigit(*text) || (*text && strchr("?$#@", *text))){
+        name = makeStr(text, 1);
+        p->i += 2;
+    }else{
+        length = variableNameLength(text);
+        if(length == 0) return 0;
+        name = makeStr(text, length);
+        p->i += length + 1;
+    }
+    parserFlush(p);
+    parserAddPart(p, PART_VARIABLE, quoted)->text = name;
+    return 1;
+}
+
+command_list* parseList(char *text, int *i, char terminator, char **error);
+
+// Parses $(...) or `...` at current position
+void parseSubstitution(command_parser *p, char quoted){
+    char *inner;
+    int length = 0, start;
+    command_list *list;
+    if(p->text[p->i] == '`'){
+        // Inner command ends at first unescaped backtick, escapes for nested backticks are removed before parsing it
+        inner = malloc(strlen(p->text + p->i) + 1);
+        for(p->i++; p->text[p->i] && p->text[p->i] != '`'; p->i++){
+            if(p->text[p->i] == '\\' && p->text[p->i+1] && strchr("`\\$", p->text[p->i+1])) p->i++;
+            inner[length++] = p->text[p->i];
+        }
+        inner[length] = '\0';
+        if(p->text[p->i] != '`') p->error = "Unterminated command substitution";
+        else p->i++;
+        start = 0;
+        list = p->error ? NULL : parseList(inner, &start, '\0', &p->error);
+        free(inner);
+    }else{
+        p->i += 2;
+        list = parseList(p->text, &p->i, ')', &p->error);
+        if(list) p->i++;
+    }
+    if(p->error){
+        freeCommandList(list);
+        return;
+    }
+    parserFlush(p);
+    parserAddPart(p, PART_SUBSTITUTION, quoted)->list = list;
+}
+
+// Parses name() { body } when current word is a name at start of a command, returns 0 if it is not a definition
+int parseFunction(command_parser *p){
+    int previous = p->list->count - 2;
+    word_part *name;
+    command_token *function;
+    command_list *body;
+    parserFlush(p);
+    if(p->word == NULL || p->word->partCount != 1 || (previous >= 0 && p->list->tokens[previous].type != TOKEN_SEPARATOR)) return 0;
+    name = p->word->parts;
+    if(name->type != PART_LITERAL || name->quoted || variableNameLength(name->text) != (int)strlen(name->text)) return 0;
+    function = p->word;
+    function->type = TOKEN_FUNCTION;
+    p->word = NULL;
+    for(p->i += 2; IS_SPACE(p->text[p->i]); p->i++);
+    if(p->text[p->i] != '{'){
+        p->error = "Function body has to be inside { }";
+        return 1;
+    }
+    p->i++;
+    body = parseList(p->text, &p->i, '}', &p->error);
+    if(body) p->i++;
+    function->body = body;
+    parserAddToken(p, TOKEN_SEPARATOR); // Definition is a command on its own
+    return 1;
+}
+
+// Parses <<DELIMITER or <<-DELIMITER, body is read when line ends
+void parseHeredoc(command_parser *p){
+    pending_heredoc *heredoc;
+    char strip = p->text[p->i+2] == '-';
+    parserEndWord(p);
+    ADJUST_CAPACITY(p->heredocs, p->heredocCount, 0, sizeof(pending_heredoc));
+    heredoc = p->heredocs + p->heredocCount++;
+    heredoc->strip = strip;
+    heredoc->token = p->list->count;
+    p->i = heredocDelimiter(p->text, p->i + 2 + strip, &heredoc->delimiter, &heredoc->quoted);
+    parserAddToken(p, TOKEN_HEREDOC);
+    if(heredoc->delimiter[0] == '\0') p->error = "Here-document needs a delimiter";
+}
+
+// Reads bodies of here-documents of line that just ended, unquoted ones are expanded like inside double quotes
+void parseHeredocBodies(command_parser *p){
+    pending_heredoc *heredoc;
+    char *text = p->text;
+    int k, end, next, lineStart;
+    for(k = 0; k < p->heredocCount; k++){
+        heredoc = p->heredocs + k;
+        if(!p->error && (end = heredocFind(text, p->i, heredoc->delimiter, heredoc->strip, &next)) < 0) p->error = unterminatedHeredoc;
+        free(heredoc->delimiter);
+        if(p->error) continue;
+        p->word = p->list->tokens + heredoc->token;
+        for(lineStart = 1; !p->error && p->i < end;){
+            if(lineStart && heredoc->strip && text[p->i] == '\t'){
+                p->i++;
+                continue;
+            }
+            lineStart = text[p->i] == '\n';
+            if(heredoc->quoted){
+                parserAppend(p, text[p->i++], 1);
+            }else if(text[p->i] == '\\' && text[p->i+1] && strchr("$`\\\n", text[p->i+1])){
+                if(text[p->i+1] != '\n') parserAppend(p, text[p->i+1], 1);
+                p->i += 2;
+            }else if(text[p->i] == '`' || (text[p->i] == '$' && text[p->i+1] == '(')){
+                parseSubstitution(p, 1);
+            }else if(text[p->i] != '$' || !parseVariable(p, 1)){
+                parserAppend(p, text[p->i++], 1);
+            }
+        }
+        parserFlush(p);
+        if(p->word->partCount == 0) parserAddPart(p, PART_LITERAL, 1)->text = makeStr("", 0);
+        p->word = NULL;
+        p->i = next;
+    }
+    p->heredocCount = 0;
+}
+
+// Parses text starting from *i until terminator, *i is left at terminator.
+// Terminator } only ends the list between words, like a}b is a word.
+// Returns NULL and sets error if command is not valid.
+command_list* parseList(char *text, int *i, char terminator, char **error){
+    command_parser p;
+    char ch;
+    int k;
+    p.text = text;
+    p.i = *i;
+    p.error = NULL;
+    p.list = malloc(sizeof(command_list));
+    p.list->tokens = NULL;
+    p.list->count = 0;
+    p.word = NULL;
+    p.literal = NULL;
+    p.literalLength = 0;
+    p.literalCapacity = 0;
+    p.literalQuoted = 0;
+    p.heredocs = NULL;
+    p.heredocCount = 0;
+
+    while(!p.error && ((ch = text[p.i]) != terminator || (terminator == '}' && p.word))){
+        if(ch == '\0'){
+            p.error = terminator == '}' ? "Missing } of function body" : "Unterminated command substitution";
+            break;
+        }
+        switch (ch)
+        {
+        case '|':
+            parserEndWord(&p);
+            parserAddToken(&p, TOKEN_PIPE);
+            p.i++;
+            break;
+        case ';':
+        case '\n':
+            parserEndWord(&p);
+            parserAddToken(&p, TOKEN_SEPARATOR);
+            p.i++;
+            if(ch == '\n' && p.heredocCount) parseHeredocBodies(&p);
+            break;
+        case ' ':
+        case '\t':
+            parserEndWord(&p);
+            p.i++;
+            break;
+        case '<':
+            if(text[p.i+1] == '<'){
+                parseHeredoc(&p);
+                break;
+            }
+            parserAppend(&p, ch, 0);
+            p.i++;
+            break;
+        case '(':
+            if(text[p.i+1] == ')' && parseFunction(&p)) break;
+            parserAppend(&p, ch, 0);
+            p.i++;
+            break;
+        case '\\':
+            if(text[p.i+1] == '\n'){ // Line continuation
+                p.i += 2;
+                break;
+            }
+            if(text[p.i+1]) p.i++;
+            parserAppend(&p, text[p.i++], 1);
+            break;
+        case '\'':
+            if(p.word == NULL) p.word = parserAddToken(&p, TOKEN_WORD);
+            for(p.i++; text[p.i] && text[p.i] != '\''; p.i++) parserAppend(&p, text[p.i], 1);
+            if(text[p.i]) p.i++;
+            break;
+        case '\"':
+            if(p.word == NULL) p.word = parserAddToken(&p, TOKEN_WORD);
+            for(p.i++; !p.error && text[p.i] && text[p.i] != '\"';){
+                if(text[p.i] == '\\' && text[p.i+1] && strchr("$`\"\\\n", text[p.i+1])){
+                    if(text[p.i+1] != '\n') parserAppend(&p, text[p.i+1], 1);
+                    p.i += 2;
+                }else if(text[p.i] == '`' || (text[p.i] == '$' && text[p.i+1] == '(')){
+                    parseSubstitution(&p, 1);
+                }else if(text[p.i] != '$' || !parseVariable(&p, 1)){
+                    parserAppend(&p, text[p.i++], 1);
+                }
+            }
+            if(text[p.i] == '\"') p.i++;
+            break;
+        case '`':
+            parseSubstitution(&p, 0);
+            break;
+        case '$':
+            if(text[p.i+1] == '('){
+                parseSubstitution(&p, 0);
+                break;
+            }
+            if(parseVariable(&p, 0)) break;
+            // fall through
+        default:
+            parserAppend(&p, ch, 0);
+            p.i++;
+            break;
+        }
+    }
+    parserEndWord(&p);
+    if(p.heredocCount && !p.error) p.error = unterminatedHeredoc; // Line with << is last one
+    for(k = 0; k < p.heredocCount; k++) free(p.heredocs[k].delimiter);
+    free(p.heredocs);
+    free(p.literal);
+    *i = p.i;
+    if(p.error){
+        *error = p.error;
+        freeCommandList(p.list);
+        return NULL;
+    }
+    return p.list;
+}
+
+// Parses command into tokens, prints error and returns NULL if it is not valid
+command_list* parseCommand(char *command){
+    int i = 0;
+    char *error = NULL;
+    command_list *list = parseList(command, &i, '\0', &error);
+    if(list == NULL) printf("Error: %s!\n\r", error);
+    return list;
+}
+
+command_list* copyCommandList(command_list *list, int expandAliases);
+
+// Returns alias that word names, word has to be a plain name without quotes or expansions
+shell_definition* wordAlias(command_token *word){
+    if(word->type != TOKEN_WORD || word->partCount != 1 || word->parts[0].type != PART_LITERAL || word->parts[0].quoted) return NULL;
+    return *findDefinition(state.aliases, word->parts[0].text);
+}
+
+// Appends copies of tokens of list to target. When expandAliases is set, aliases at start of commands are replaced by
+// copies of their bodies, an alias is not replaced again inside its own body so expansion always ends.
+void copyTokens(command_list *target, command_list *list, int expandAliases){
+    command_token *token, *source;
+    shell_definition *alias;
+    int i, j, command = target->count == 0 || IS_COMMAND_BOUNDARY(target->tokens[target->count-1].type);
+    for(i = 0; i < list->count; i++){
+        source = list->tokens + i;
+        if(expandAliases && command && (alias = wordAlias(source)) && !alias->active){
+            alias->active = 1;
+            copyTokens(target, alias->body, 1);
+            alias->active = 0;
+            command = target->count == 0 || IS_COMMAND_BOUNDARY(target->tokens[target->count-1].type);
+            continue;
+        }
+        ADJUST_CAPACITY(target->tokens, target->count, 0, sizeof(command_token));
+        token = target->tokens + target->count++;
+        *token = *source;
+        token->parts = source->partCount ? malloc(sizeof(word_part) * source->partCount) : NULL;
+        for(j = 0; j < source->partCount; j++){
+            token->parts[j] = source->parts[j];
+            if(source->parts[j].text) token->parts[j].text = makeStr(source->parts[j].text, strlen(source->parts[j].text));
+            if(source->parts[j].list) token->parts[j].list = copyCommandList(source->parts[j].list, expandAliases);
+        }
+        if(source->body) token->body = copyCommandList(source->body, 0); // Aliases in body are replaced when function is defined
+        command = IS_COMMAND_BOUNDARY(source->type);
+    }
+}
+
+command_list* copyCommandList(command_list *list, int expandAliases){
+    command_list *copy = malloc(sizeof(command_list));
+    copy->tokens = NULL;
+    copy->count = 0;
+    copyTokens(copy, list, expandAliases);
+    return copy;
+}
+
+void freeDefinition(shell_definition *definition){
+    free(definition->name);
+    free(definition->text);
+    freeCommandList(definition->body);
+    free(definition);
+}
+
+// Removes definition from its table, a function that is running is freed when its last call returns
+void removeDefinition(shell_definition **definition){
+    shell_definition *removed = *definition;
+    if(removed == NULL) return;
+    *definition = removed->next;
+    if(removed->running) removed->removed = 1;
+    else freeDefinition(removed);
+    commandCacheClear();
+}
+
+// Adds or replaces definition, takes ownership of body
+void addDefinition(shell_definition **table, char *name, char *text, command_list *body){
+    shell_definition **slot = findDefinition(table, name);
+    shell_definition *definition = malloc(sizeof(shell_definition));
+    removeDefinition(slot);
+    definition->name = makeStr(name, strlen(name));
+    definition->text = text ? makeStr(text, strlen(text)) : NULL;
+    definition->body = body;
+    definition->running = 0;
+    definition->active = 0;
+    definition->removed = 0;
+    definition->next = *slot;
+    *slot = definition;
+    commandCacheClear();
+}
+
+// Checks if there is an open escape or here-document in current command, return nonzero if command continues on next line
+char getEscapeStatus(){
+    char ch;
+    int i, k, next;
+    char escapes = 0;
+    char *text = makeStr(state.content, state.length);
+    pending_heredoc *heredocs = NULL;
+    int heredocCount = 0;
+    
+    for(i = 0; i < state.length; i++){
+        ch = text[i];
+
+        if(escapes){
+            if(escapes & 0x8){
+                escapes = escapes ^ 0x8;
+            }else if(escapes & 0x4){
+                if(ch == '\'') escapes = 0;
+            }else{ 
+                if(ch == '\\') escapes |= 0x8;
+                else if(ch == '\"') escapes = 0;
+            }
+        }else{
+            switch (ch)
+            {
+            case '\\':
+                escapes = 0x8;
+                break;
+            case '\'':
+                escapes = 0x4;
+                break;
+            case '\"':
+                escapes = 0x2;
+                break;
+            case '<':
+                if(text[i+1] != '<') break;
+                ADJUST_CAPACITY(heredocs, heredocCount, 0, sizeof(pending_heredoc));
+                heredocs[heredocCount].strip = text[i+2] == '-';
+                i = heredocDelimiter(text, i + 2 + heredocs[heredocCount].strip, &heredocs[heredocCount].delimiter, &heredocs[heredocCount].quoted) - 1;
+                heredocCount++;
+                break;
+            case '\n':
+                // Bodies are skipped since quotes in them are just text
+                for(k = 0; k < heredocCount; k++){
+                    if(heredocs[k].delimiter[0] && !escapes){
+                        if(heredocFind(text, i + 1, heredocs[k].delimiter, heredocs[k].strip, &next) >= 0) i = next - 1;
+                        else escapes = ESCAPES_HEREDOC;
+                    }
+                    free(heredocs[k].delimiter);
+                }
+                heredocCount = 0;
+                if(escapes) i = state.length;
+                break;
+            }
+        }
+    }
+    for(k = 0; k < heredocCount; k++){ // Line with << is last one
+        if(heredocs[k].delimiter[0] && !escapes) escapes = ESCAPES_HEREDOC;
+        free(heredocs[k].delimiter);
+    }
+    free(heredocs);
+    free(text);
+    return escapes;
+}
+
+void heredocClose(int fd, heredoc_writer *writer){
+    removeEventSource(fd);
+    close(fd);
+    free(writer->data);
+    free(writer);
+    state.heredocWriters--;
+}
+
+// Writes as much of here-document as pipe accepts, called by event loop whenever command can take more
+void heredocWrite(int fd, void *data){
+    heredoc_writer *writer = data;
+    long result = write(fd, writer->data + writer->written, writer->length - writer->written);
+    if(result > 0) writer->written += result;
+    // Command may exit without reading all of it
+    if(writer->written == writer->length || (result < 0 && errno != EAGAIN && errno != EINTR)) heredocClose(fd, writer);
+}
+
+// Here-document is written by event loop while command runs, so a body larger than pipe buffer
+// never blocks shell and is never copied to a file. Body in args is taken over.
+void heredocStart(int *heredocPipe, char **body){
+    heredoc_writer *writer = malloc(sizeof(heredoc_writer));
+    close(heredocPipe[0]);
+    fcntl(heredocPipe[1], F_SETFL, O_NONBLOCK);
+    writer->data = *body;
+    writer->length = strlen(*body);
+    writer->written = 0;
+    *body = heredocMarker; // So freeArgs skips it
+    state.heredocWriters++;
+    addEventSource(heredocPipe[1], POLLOUT, heredocWrite, writer);
+}
+
+// Stops writing here-documents when output of commands ended, so waiting them can not hang
+void heredocAbandon(){
+    int i;
+    for(i = eventSourceCount - 1; i >= 0; i--){
+        if(eventSources[i].handler == heredocWrite) heredocClose(eventSources[i].fd, eventSources[i].data);
+    }
+}
+
+#define IOPRIO_CLASS_SHIFT 13 // ioprio_set has no wrapper in libc, so its value is built here
+const char *ioClassNames[] = {"none", "rt", "be", "idle"};
+
+// Parses list like 0-3,8 into cpus, returns 0 if it is not valid
+int cpuListParse(char *text, cpu_set_t *cpus){
+    long first, last;
+    char *end;
+    CPU_ZERO(cpus);
+    while(1){
+        first = last = strtol(text, &end, 10);
+        if(end == text || first < 0) return 0;
+        if(*end == '-'){
+            text = end + 1;
+            last = strtol(text, &end, 10);
+            if(end == text || last < first) return 0;
+        }
+        if(last >= CPU_SETSIZE) return 0;
+        for(; first <= last; first++) CPU_SET(first, cpus);
+        if(*end == '\0') return 1;
+        if(*end != ',') return 0;
+        text = end + 1;
+    }
+}
+
+void cpuListFormat(cpu_set_t *cpus, char *text){
+    int first, last;
+    *text = '\0';
+    for(first = 0; first < CPU_SETSIZE; first = last + 1){
+        if(!CPU_ISSET(first, cpus)){
+            last = first;
+            continue;
+        }
+        for(last = first; last + 1 < CPU_SETSIZE && CPU_ISSET(last + 1, cpus); last++);
+        text += sprintf(text, *text ? ",%d" : "%d", first);
+        if(last > first) text += sprintf(text, "-%d", last);
+    }
+}
+
+// Words of place and its options before command, 0 if command is not placed
+int placementWords(char **command){
+    int i = 1;
+    if(strcmp(command[0], "place") != 0) return 0;
+    while(command[i] && command[i][0] == '-' && command[i][1] && strcmp(command[i], "--") != 0) i += command[i+1] ? 2 : 1; // Option without value is reported by placementParse
+    if(command[i] && strcmp(command[i], "--") == 0) i++;
+    return i;
+}
+
+// Options of place override placement, value - returns a setting to what shell has
+int placementParse(char **command, int words, stage_placement *placement){
+    int i;
+    long value;
+    char *option, *text, *end;
+    for(i = 1; i + 1 < words; i += 2){
+        option = command[i];
+        text = command[i+1];
+        if(strcmp(text, "-") == 0){
+            if(strcmp(option, "-c") == 0) placement->hasCpus = 0;
+            else if(strcmp(option, "-n") == 0) placement->hasNice = 0;
+            else if(strcmp(option, "-i") == 0) placement->ioPriority = -1;
+            else if(strcmp(option, "-g") == 0) placement->cgroup = NULL;
+            else break;
+        }else if(strcmp(option, "-c") == 0){
+            if(!cpuListParse(text, &placement->cpus)){
+                fprintf(stderr, "Error: Invalid CPU list %s!\n\r", text);
+                return 0;
+            }
+            placement->hasCpus = 1;
+        }else if(strcmp(option, "-n") == 0){
+            value = strtol(text, &end, 10);
+            if(end == text || *end || value < -20 || value > 19){
+                fprintf(stderr, "Error: Nice value must be between -20 and 19!\n\r");
+                return 0;
+            }
+            placement->hasNice = 1;
+            placement->nice = value;
+        }else if(strcmp(option, "-i") == 0){
+            for(value = 1; value < 4; value++){
+                end = text + strlen(ioClassNames[value]);
+                if(strncmp(text, ioClassNames[value], end - text) == 0 && (*end == '\0' || *end == ':')) break;
+            }
+            if(value == 4 || (*end == ':' && (end[1] < '0' || end[1] > '7' || end[2]))){
+                fprintf(stderr, "Error: I/O priority must be rt, be or idle with optional :0-7 level!\n\r");
+                return 0;
+            }
+            // Idle class has no levels, others get middle level unless given
+            placement->ioPriority = value << IOPRIO_CLASS_SHIFT | (*end == ':' ? end[1] - '0' : value == 3 ? 0 : 4);
+        }else if(strcmp(option, "-g") == 0) placement->cgroup = text;
+        else break;
+    }
+    if(i + 1 == words && strchr("cnig", command[i][1]) && command[i][2] == '\0'){
+        fprintf(stderr, "Error: Usage: place option %s needs a value!\n\r", command[i]);
+        return 0;
+    }
+    if(i < words && strcmp(command[i], "--") != 0){
+        fprintf(stderr, "Error: Usage: place has no option %s, it takes [-c CPUS] [-n NICE] [-i CLASS[:LEVEL]] [-g CGROUP] [COMMAND]!\n\r", command[i]);
+        return 0;
+    }
+    return 1;
+}
+
+// Moves this process to cgroup, which is created if missing, under cgroup v2 mount
+int cgroupEnter(char *cgroup){
+    char line[PATH_MAX + 64], mount[PATH_MAX], type[32], path[PATH_MAX + 64];
+    FILE *mounts = fopen("/proc/mounts", "r");
+    int fd, length;
+    strcpy(mount, "/sys/fs/cgroup");
+    while(mounts && fgets(line, sizeof(line), mounts)){
+        if(sscanf(line, "%*s %4095s %31s", path, type) == 2 && strcmp(type, "cgroup2") == 0){
+            strcpy(mount, path);
+            break;
+        }
+    }
+    if(mounts) fclose(mounts);
+    snprintf(path, sizeof(path), "%s/%s", mount, cgroup);
+    if(mkdir(path, 0755) < 0 && errno != EEXIST) return 0;
+    strcat(path, "/cgroup.procs");
+    if((fd = open(path, O_WRONLY)) < 0) return 0;
+    length = sprintf(line, "%d", getpid());
+    length = write(fd, line, length);
+    close(fd);
+    return length > 0;
+}
+
+// Applies placement to this child, returns 0 after printing error if kernel refuses any of it.
+// Errors go to stderr since stdout of a stage is the pipe to next one.
+int placementApply(stage_placement *placement){
+    if(placement->cgroup && !cgroupEnter(placement->cgroup)){
+        fprintf(stderr, "Error: Could not enter cgroup %s: %s!\n\r", placement->cgroup, strerror(errno));
+        return 0;
+    }
+    if(placement->hasCpus && sched_setaffinity(0, sizeof(cpu_set_t), &placement->cpus) < 0){
+        fprintf(stderr, "Error: Could not set CPUs: %s!\n\r", strerror(errno));
+        return 0;
+    }
+    if(placement->hasNice && setpriority(PRIO_PROCESS, 0, placement->nice) < 0){
+        fprintf(stderr, "Error: Could not set nice value: %s!\n\r", strerror(errno));
+        return 0;
+    }
+    if(placement->ioPriority >= 0 && syscall(SYS_ioprio_set, 1, 0, placement->ioPriority) < 0){ // 1 is IOPRIO_WHO_PROCESS
+        fprintf(stderr, "Error: Could not set I/O priority: %s!\n\r", strerror(errno));
+        return 0;
+    }
+    return 1;
+}
+
+// Returns line of /proc file starting with prefix without it, NULL if there is none
+char* procLine(char *path, char *prefix){
+    char line[4096];
+    char *result = NULL;
+    FILE *file = fopen(path, "r");
+    if(file == NULL) return NULL;
+    while(fgets(line, sizeof(line), file)){
+        if(strncmp(line, prefix, strlen(prefix)) == 0){
+            line[strcspn(line, "\n")] = '\0';
+            result = makeStr(line + strlen(prefix), strlen(line + strlen(prefix)));
+            break;
+        }
+    }
+    fclose(file);
+    return result;
+}
+
+// Reads where exited stage ran, it is still in /proc until waitpid reaps it
+void stageReadProc(job_stage *stage){
+    char path[64];
+    char *stat, *fields;
+    int i;
+    sprintf(path, "/proc/%d/stat", stage->pid);
+    stat = procLine(path, "");
+    fields = stat ? strrchr(stat, ')') : NULL; // Name of command may contain spaces
+    for(i = 0; fields && i < 39; i++){
+        if(i == 17) stage->nice = atoi(fields);
+        if(i == 37) stage->processor = atoi(fields);
+        fields = strchr(fields + 1, ' ');
+    }
+    free(stat);
+    sprintf(path, "/proc/%d/status", stage->pid);
+    stage->cpus = procLine(path, "Cpus_allowed_list:\t");
+    sprintf(path, "/proc/%d/cgroup", stage->pid);
+    stage->cgroup = procLine(path, "0::");
+    stage->readBytes = stage->writtenBytes = 0;
+    if(state.profile == NULL) return;
+    sprintf(path, "/proc/%d/io", stage->pid);
+    if((stat = procLine(path, "rchar: "))) stage->readBytes = atol(stat);
+    free(stat);
+    if((stat = procLine(path, "wchar: "))) stage->writtenBytes = atol(stat);
+    free(stat);
+}
+
+void jobFree(){
+    int i;
+    for(i = 0; i < state.jobCount; i++){
+        free(state.job[i].name);
+        free(state.job[i].cpus);
+        free(state.job[i].cgroup);
+    }
+    free(state.job);
+    state.job = NULL;
+    state.jobCount = 0;
+}
+
+// place OPTIONS COMMAND runs command with them, place OPTIONS alone changes defaults of all stages
+int builtinPlace(char **args){
+    stage_placement placement = state.placement;
+    char cpus[CPU_SETSIZE * 4];
+    int words = placementWords(args);
+    if(args[words]){
+        printf("Error: Placed command can not run in shell!\n\r");
+        return 1;
+    }
+    if(words == 1){
+        cpuListFormat(&placement.cpus, cpus);
+        printf("cpus: %s\n\r", placement.hasCpus ? cpus : "-");
+        if(placement.hasNice) printf("nice: %d\n\r", placement.nice);
+        else printf("nice: -\n\r");
+        if(placement.ioPriority < 0) printf("io: -\n\r");
+        else printf("io: %s:%d\n\r", ioClassNames[placement.ioPriority >> IOPRIO_CLASS_SHIFT], placement.ioPriority & 7);
+        printf("cgroup: %s\n\r", placement.cgroup ? placement.cgroup : "-");
+        return 0;
+    }
+    fflush(stdout);
+    if(!placementParse(args, words, &placement)) return 2;
+    if(placement.cgroup != state.placement.cgroup){
+        free(state.placement.cgroup);
+        if(placement.cgroup) placement.cgroup = makeStr(placement.cgroup, strlen(placement.cgroup));
+    }
+    state.placement = placement;
+    return 0;
+}
+
+// Lists stages of last pipeline, -v also shows where they ran
+int builtinJobs(char **args){
+    int verbose = args[1] && strcmp(args[1], "-v") == 0;
+    int i;
+    job_stage *stage;
+    char io[16];
+    if(verbose) printf("%7s %6s %4s %-12s %4s %-7s %9s  %-20s %s\n\r", "PID", "STATUS", "CPU", "ALLOWED", "NICE", "IO", "CPU TIME", "CGROUP", "COMMAND");
+    for(i = 0; i < state.jobCount; i++){
+        stage = state.job + i;
+        if(!verbose){
+            printf("%7d %6d  %s\n\r", stage->pid, stage->status, stage->name);
+            continue;
+        }
+        if(stage->ioPriority < 0) strcpy(io, "-");
+        else sprintf(io, "%s:%d", ioClassNames[stage->ioPriority >> IOPRIO_CLASS_SHIFT], stage->ioPriority & 7);
+        printf("%7d %6d %4d %-12s %4d %-7s %7ldms  %-20s %s\n\r", stage->pid, stage->status, stage->processor,
+            stage->cpus ? stage->cpus : "?", stage->nice, io, stage->cpuTime, stage->cgroup ? stage->cgroup : "?", stage->name);
+    }
+    return 0;
+}
+
+// Event sources belong to shell, here-documents of other stages are closed so their readers get end of file
+void childInit(){
+    int i;
+    isChild = 1;
+    for(i = 0; i < eventSourceCount; i++) close(eventSources[i].fd);
+    eventSourceCount = 0;
+    state.heredocWriters = 0;
+    state.controlFd = -1;
+    state.profile = NULL;
+}
+
+// Executes command and returns a pipe
+// Standard error of commands goes to errorFd, or to returned pipe too if it is -1
+int* executeCommand(char **args, int *inputPipe, int errorFd){
+    int execResult;
+    int pid;
+    int pipeOperator = 0;
+    int i, j;
+    char **heredoc = NULL; // Body of last here-document of this stage
+    int heredocPipe[2];
+    char **command, *name;
+    stage_placement placement = state.placement;
+    int placed; // Words of place prefix, -1 if its options are wrong
+    
+    int *outputPipe = malloc(sizeof(int)*2);
+    if (pipe(outputPipe)==-1){
+        printf("Pipe Error!\n\r");
+        exit(1);
+    }
+
+    while(args[pipeOperator] && args[pipeOperator] != pipeMarker) pipeOperator++;
+    if(args[pipeOperator] == NULL)
+        pipeOperator = 0;
+    for(i = 0; args[i] && args[i] != pipeMarker; i++) if(args[i] == heredocMarker) heredoc = args + ++i;
+    if(heredoc && pipe(heredocPipe) == -1) heredoc = NULL;
+    for(command = args; *command == assignMarker; command += 2);
+    fflush(stdout); // Otherwise child would write what is buffered again, and errors on stderr would come before it
+    placed = *command ? placementWords(command) : 0;
+    if(placed && !placementParse(command, placed, &placement)) placed = -1;
+    
+    getEnvp(); // Built in parent so children share it unless variables changed
+    pid = fork();
+    if(pid < 0){
+        printf("Fork Error!\n\r");
+        free(outputPipe);
+        if(heredoc){
+            close(heredocPipe[0]);
+            close(heredocPipe[1]);
+        }
+        return NULL;
+    }
+    if(pid > 0){
+        //parent
+        ADJUST_CAPACITY(state.stages, state.stageCount, 0, sizeof(job_stage));
+        command += placed > 0 ? placed : 0;
+        name = *command && *command != pipeMarker ? *command : "";
+        state.stages[state.stageCount].pid = pid;
+        state.stages[state.stageCount].name = makeStr(name, strlen(name));
+        state.stages[state.stageCount].ioPriority = placement.ioPriority;
+        state.stageCount++;
+        if(inputPipe){ // Stage that reads it is started, writer must get SIGPIPE if that stage exits early
+            close(inputPipe[0]);
+            free(inputPipe);
+        }
+        if(heredoc) heredocStart(heredocPipe, heredoc);
+        if(pipeOperator){
+            //In this case outputPipe will be used between childs so this process (parent) has no business with it
+            //But if we close both end pipe will be closed so we let read end open and close write end
+            //We have to close writing end otherwise child which reads it may hang forever.
+            close(outputPipe[1]);
+            return executeCommand(args+pipeOperator+1, outputPipe, errorFd);
+        }else
+            return outputPipe;
+            
+    }
+    childInit();
+    close(outputPipe[0]); // Close reading end of output pipe
+    // Placed before output is redirected so errors go to stderr of shell and not to pipe to next stage
+    if(placed < 0) exit(2);
+    if(!placementApply(&placement)) exit(126);
+    //child
+    //Check if there is a pipe operator
+    if(pipeOperator) args[pipeOperator] = NULL;
+    if(inputPipe){
+        close(STDIN_FILENO);
+        // Writing end is closed by parent before this stage is started, its number may be reused by outputPipe
+        dup2(inputPipe[0], STDIN_FILENO);
+        //close(inputPipe[0]);
+    }
+    if(heredoc){ // Here-document replaces input from pipe
+        dup2(heredocPipe[0], STDIN_FILENO);
+        close(heredocPipe[0]);
+        close(heredocPipe[1]);
+    }
+    for(i = j = 0; args[i]; i++){
+        if(args[i] == heredocMarker) i++;
+        else args[j++] = args[i];
+    }
+    args[j] = NULL;
+    setvbuf(stdout, NULL, _IONBF, 0);
+    setvbuf(stdin, NULL, _IONBF, 0);
+    dup2(outputPipe[1], STDOUT_FILENO);
+    dup2(errorFd < 0 ? outputPipe[1] : errorFd, STDERR_FILENO);
+    environ = state.envp;
+    if(args[0] == assignMarker){ // Assignments before command only change its environment
+        for(; args[0] == assignMarker; args += 2) assignVariable(args[1], 1);
+        environ = getEnvp();
+    }
+    args += placed;
+    if(args[0] == NULL) exit(0); // Empty command in pipeline
+    pipeLineEnds();
+    if(*findDefinition(state.functions, args[0])) exit(runFunction(*findDefinition(state.functions, args[0]), args));
+    // Builtins in a pipeline or substitution runs in this child so their output goes to pipe
+    for(i = 0; builtins[i].name; i++){
+        if(strcmp(args[0], builtins[i].name) == 0) exit(builtins[i].run(args));
+    }
+    signal(SIGPIPE, SIG_DFL); // Shell code in child ignores it, but commands must be stopped by it when reader exits
+    execResult = execvp(args[0], args);
+    if(execResult < 0) fprintf(stderr, "Error: %s!\n\r", strerror(errno));
+    fclose(stderr);
+    fclose(stdout);
+    fclose(stdin);
+    close(outputPipe[1]);
+    close(outputPipe[0]);
+    exit(127);
+}
+
+// Waits stages of pipeline starting from given index and returns status of last one
+// They are kept as last job for jobs builtin
+int waitStages(int first){
+    int i, status, result = 0;
+    job_stage *stage;
+    pid_t waited;
+    siginfo_t info;
+    struct rusage usage;
+    jobFree();
+    for(i = first; i < state.stageCount; i++){
+        stage = state.stages + i;
+        stage->status = -1;
+        stage->processor = stage->nice = 0;
+        stage->cpuTime = 0;
+        stage->cpus = stage->cgroup = NULL;
+        while(waitid(P_PID, stage->pid, &info, WEXITED | WNOWAIT) == -1 && errno == EINTR);
+        stageReadProc(stage);
+        while((waited = wait4(stage->pid, &status, 0, &usage)) == -1 && errno == EINTR);
+        if(waited == -1) continue;
+        stage->cpuTime = (usage.ru_utime.tv_sec + usage.ru_stime.tv_sec) * 1000 + (usage.ru_utime.tv_usec + usage.ru_stime.tv_usec) / 1000;
+        if(WIFEXITED(status)) result = WEXITSTATUS(status);
+        else if(WIFSIGNALED(status)) result = 128 + WTERMSIG(status);
+        stage->status = result;
+    }
+    state.jobCount = state.stageCount - first;
+    state.job = malloc(sizeof(job_stage) * (state.jobCount + 1));
+    memcpy(state.job, state.stages + first, sizeof(job_stage) * state.jobCount);
+    state.stageCount = first;
+    return result;
+}
+
+char** expandNextCommand(command_list *list, int *next);
+
+// Runs commands and returns their standard output. Output is read into a buffer that grows by doubling,
+// and each read fills all free space of it, so large outputs are captured with few system calls.
+// Standard error goes to errorFd, or is captured too if it is -1.
+char* captureOutput(command_list *list, long *length, int errorFd){
+    char **args;
+    char *output = malloc(RELAY_BUFFER_SIZE);
+    long capacity = RELAY_BUFFER_SIZE;
+    long result;
+    int firstStage = state.stageCount; // Substitutions run while expanding, possibly inside another one
+    int next = 0;
+    int *outputPipe;
+    *length = 0;
+    // Commands separated by ; run one after another and their outputs are joined
+    while((args = expandNextCommand(list, &next))){
+        outputPipe = executeCommand(args, NULL, errorFd);
+        freeArgs(args);
+        if(outputPipe == NULL) continue;
+        close(outputPipe[1]);
+        while(1){
+            if(capacity - *length < RELAY_BUFFER_SIZE){
+                capacity *= 2;
+                output = realloc(output, capacity);
+            }
+            if(eventSourceCount && processEvents(outputPipe[0], -1) <= 0) continue;
+            result = read(outputPipe[0], output + *length, capacity - *length - 1);
+            if(result < 0 && errno == EINTR) continue;
+            if(result <= 0) break;
+            *length += result;
+        }
+        close(outputPipe[0]);
+        free(outputPipe);
+        heredocAbandon();
+        state.lastStatus = waitStages(firstStage);
+    }
+    while(*length > 0 && output[*length-1] == '\n') (*length)--; // Trailing newlines are removed
+    output[*length] = '\0';
+    return output;
+}
+
+unsigned int globHash(char *path){
+    unsigned int hash = 2166136261u;
+    for(; *path; path++) hash = (hash ^ (unsigned char)*path) * 16777619u;
+    return hash;
+}
+
+// Caller holds globCache.lock while other threads may use cache
+glob_dir* globCacheFind(char *path, unsigned int hash){
+    glob_dir *dir;
+    if(globCache.buckets == NULL) return NULL;
+    for(dir = globCache.buckets[hash % globCache.bucketCount]; dir; dir = dir->next){
+        if(dir->hash == hash && strcmp(dir->path, path) == 0) return dir;
+    }
+    return NULL;
+}
+
+void globCacheInsert(glob_dir *dir){
+    glob_dir **buckets, *next;
+    int i, count;
+    if(globCache.count >= globCache.bucketCount * 2){
+        count = globCache.bucketCount ? globCache.bucketCount * 2 : GLOB_CACHE_SIZE;
+        buckets = calloc(count, sizeof(glob_dir*));
+        for(i = 0; i < globCache.bucketCount; i++){
+            for(; globCache.buckets[i]; globCache.buckets[i] = next){
+                next = globCache.buckets[i]->next;
+                globCache.buckets[i]->next = buckets[globCache.buckets[i]->hash % count];
+                buckets[globCache.buckets[i]->hash % count] = globCache.buckets[i];
+            }
+        }
+        free(globCache.buckets);
+        globCache.buckets = buckets;
+        globCache.bucketCount = count;
+    }
+    dir->next = globCache.buckets[dir->hash % globCache.bucketCount];
+    globCache.buckets[dir->hash % globCache.bucketCount] = dir;
+    globCache.count++;
+}
+
+// Called after each command line so next one sees changes in file system
+void globCacheClear(){
+    glob_dir *dir;
+    int i;
+    for(i = 0; i < globCache.bucketCount; i++){
+        while((dir = globCache.buckets[i])){
+            globCache.buckets[i] = dir->next;
+            free(dir->path);
+            free(dir->names);
+            free(dir->entries);
+            free(dir);
+        }
+    }
+    free(globCache.buckets);
+    globCache.buckets = NULL;
+    globCache.bucketCount = 0;
+    globCache.count = 0;
+}
+
+// Reads entries of directory at path, "" is current directory. Takes ownership of path.
+glob_dir* globReadDir(char *path, unsigned int hash){
+    glob_dir *dir = malloc(sizeof(glob_dir));
+    DIR *stream = opendir(*path ? path : ".");
+    struct dirent *entry;
+    struct stat st;
+    int length, namesLength = 0, namesCapacity = 0;
+    unsigned char type;
+    dir->path = path;
+    dir->hash = hash;
+    dir->names = NULL;
+    dir->entries = NULL;
+    dir->count = 0;
+    dir->treeRead = 0;
+    if(stream == NULL) return dir;
+    while((entry = readdir(stream))){
+        if(entry->d_name[0] == '.' && (entry->d_name[1] == '\0' || (entry->d_name[1] == '.' && entry->d_name[2] == '\0'))) continue;
+        type = entry->d_type;
+        if(type == DT_UNKNOWN && fstatat(dirfd(stream), entry->d_name, &st, AT_SYMLINK_NOFOLLOW) == 0){
+            type = S_ISDIR(st.st_mode) ? DT_DIR : S_ISLNK(st.st_mode) ? DT_LNK : DT_REG;
+        }
+        length = strlen(entry->d_name) + 1;
+        if(namesLength + length > namesCapacity){
+            namesCapacity = (namesLength + length) * 2;
+            dir->names = realloc(dir->names, namesCapacity);
+        }
+        memcpy(dir->names + namesLength, entry->d_name, length);
+        ADJUST_CAPACITY(dir->entries, dir->count, 0, sizeof(glob_entry));
+        dir->entries[dir->count].name = namesLength;
+        dir->entries[dir->count].flags = type == DT_DIR ? GLOB_ENTRY_DIR : type == DT_LNK ? GLOB_ENTRY_LINK : 0;
+        dir->count++;
+        namesLength += length;
+    }
+    closedir(stream);
+    return dir;
+}
+
+// Returns path of name in directory at path, "" is current directory
+char* globJoin(char *path, char *name){
+    int length = strlen(path);
+    char *joined = malloc(length + strlen(name) + 2);
+    memcpy(joined, path, length);
+    if(length > 0 && path[length-1] != '/') joined[length++] = '/';
+    strcpy(joined + length, name);
+    return joined;
+}
+
+// Directories under a ** are not hidden and not symbolic links, so traversal can not loop
+int globDescends(glob_dir *dir, int i){
+    return (dir->entries[i].flags & GLOB_ENTRY_DIR) && dir->names[dir->entries[i].name] != '.';
+}
+
+// Reads directories from queue and adds their subdirectories to it until all tree is read
+void* globWorker(void *data){
+    glob_queue *queue = data;
+    glob_dir *dir;
+    char *path;
+    unsigned int hash;
+    int i;
+    pthread_mutex_lock(&queue->lock);
+    while(1){
+        while(queue->count == 0 && queue->busy > 0) pthread_cond_wait(&queue->changed, &queue->lock);
+        if(queue->count == 0) break;
+        path = queue->paths[--queue->count];
+        queue->busy++;
+        pthread_mutex_unlock(&queue->lock);
+
+        hash = globHash(path);
+        pthread_mutex_lock(&globCache.lock);
+        dir = globCacheFind(path, hash);
+        pthread_mutex_unlock(&globCache.lock);
+        if(dir){ // Read by an earlier pattern
+            free(path);
+        }else{
+            dir = globReadDir(path, hash);
+            pthread_mutex_lock(&globCache.lock);
+            globCacheInsert(dir);
+            pthread_mutex_unlock(&globCache.lock);
+        }
+
+        pthread_mutex_lock(&queue->lock);
+        for(i = 0; i < dir->count; i++){
+            if(!globDescends(dir, i)) continue;
+            if(queue->count == queue->capacity){
+                queue->capacity = queue->capacity * 2 + CAPACIY_INCREMENT;
+                queue->paths = realloc(queue->paths, sizeof(char*) * queue->capacity);
+            }
+            queue->paths[queue->count++] = globJoin(dir->path, dir->names + dir->entries[i].name);
+        }
+        dir->treeRead = 1;
+        queue->busy--;
+        pthread_cond_broadcast(&queue->changed);
+    }
+    pthread_mutex_unlock(&queue->lock);
+    return NULL;
+}
+
+// Reads whole tree under path into cache using several threads, large trees are mostly waiting on file system
+void globReadTree(char *path){
+    glob_queue queue;
+    glob_dir *dir = globCacheFind(path, globHash(path));
+    pthread_t threads[GLOB_THREADS];
+    long threadCount = sysconf(_SC_NPROCESSORS_ONLN);
+    int i, started = 0;
+    if(dir && dir->treeRead) return;
+    if(threadCount > GLOB_THREADS) threadCount = GLOB_THREADS;
+    queue.paths = malloc(sizeof(char*) * CAPACIY_INCREMENT);
+    queue.paths[0] = makeStr(path, strlen(path));
+    queue.count = 1;
+    queue.capacity = CAPACIY_INCREMENT;
+    queue.busy = 0;
+    pthread_mutex_init(&queue.lock, NULL);
+    pthread_cond_init(&queue.changed, NULL);
+    // This thread works too, so traversal completes even if threads can not be created
+    for(i = 1; i < threadCount; i++){
+        if(pthread_create(threads + started, NULL, globWorker, &queue) == 0) started++;
+    }
+    globWorker(&queue);
+    for(i = 0; i < started; i++) pthread_join(threads[i], NULL);
+    pthread_mutex_destroy(&queue.lock);
+    pthread_cond_destroy(&queue.changed);
+    free(queue.paths);
+}
+
+// Returns directory from cache, reading it if it is not there
+glob_dir* globGetDir(char *path){
+    unsigned int hash = globHash(path);
+    glob_dir *dir = globCacheFind(path, hash);
+    if(dir) return dir;
+    dir = globReadDir(makeStr(path, strlen(path)), hash);
+    globCacheInsert(dir);
+    return dir;
+}
+
+// Returns index after closing bracket of set starting at i, or 0 if it is not closed
+int globSetEnd(char *text, int i, int length){
+    i++;
+    if(i < length && (text[i] == '!' || text[i] == '^')) i++;
+    if(i < length && text[i] == ']') i++;
+    for(; i < length && text[i] != ']'; i++){
+        if(text[i] == '\\') i++;
+    }
+    return i < length ? i + 1 : 0;
+}
+
+void globCompileSet(glob_op *op, char *text, int start, int end){
+    int i = start + 1, negate = 0, first = 1;
+    unsigned char from, to;
+    op->type = GLOB_OP_SET;
+    memset(op->set, 0, sizeof(op->set));
+    if(text[i] == '!' || text[i] == '^'){
+        negate = 1;
+        i++;
+    }
+    for(; i < end - 1 && (first || text[i] != ']'); first = 0){
+        if(text[i] == '\\') i++;
+        from = to = text[i++];
+        if(text[i] == '-' && i + 1 < end - 1 && text[i+1] != ']'){
+            i++;
+            if(text[i] == '\\') i++;
+            to = text[i++];
+        }
+        for(; from <= to; from++){
+            op->set[from >> 3] |= 1 << (from & 7);
+            if(from == 255) break;
+        }
+    }
+    if(negate){
+        for(i = 0; i < 32; i++) op->set[i] = ~op->set[i];
+    }
+}
+
+// Compiles one component of pattern, backslash makes next character literal
+void globCompileComponent(glob_component *component, char *text, int length){
+    int i, end, literalLength = 0;
+    glob_op *op;
+    component->type = GLOB_LITERAL;
+    component->ops = malloc(sizeof(glob_op) * (length + 1));
+    component->opCount = 0;
+    component->text = malloc(length + 1);
+    component->dotMatched = 0;
+    if(length == 2 && text[0] == '*' && text[1] == '*'){
+        component->type = GLOB_RECURSIVE;
+        length = 0;
+    }
+    for(i = 0; i < length; i++){
+        op = component->ops + component->opCount;
+        if(text[i] == '*'){
+            component->type = GLOB_WILDCARD;
+            if(component->opCount > 0 && op[-1].type == GLOB_OP_STAR) continue;
+            op->type = GLOB_OP_STAR;
+        }else if(text[i] == '?'){
+            component->type = GLOB_WILDCARD;
+            op->type = GLOB_OP_ANY;
+        }else if(text[i] == '[' && (end = globSetEnd(text, i, length))){
+            component->type = GLOB_WILDCARD;
+            globCompileSet(op, text, i, end);
+            i = end - 1;
+        }else{
+            if(text[i] == '\\' && i + 1 < length) i++;
+            op->type = GLOB_OP_CHAR;
+            op->ch = text[i];
+            component->text[literalLength++] = text[i];
+            if(component->opCount == 0 && text[i] == '.') component->dotMatched = 1;
+        }
+        component->opCount++;
+    }
+    component->text[literalLength] = '\0';
+}
+
+// Compiles pattern whose quoted characters are escaped by backslash
+glob_pattern* globCompile(char *text){
+    glob_pattern *pattern = malloc(sizeof(glob_pattern));
+    int start, i;
+    pattern->components = NULL;
+    pattern->count = 0;
+    pattern->absolute = text[0] == '/';
+    for(start = i = 0; ; i++){
+        if(text[i] == '\\' && text[i+1]){
+            i++;
+            continue;
+        }
+        if(text[i] != '/' && text[i] != '\0') continue;
+        if(i > start){ // Empty components of // are skipped
+            ADJUST_CAPACITY(pattern->components, pattern->count, 0, sizeof(glob_component));
+            globCompileComponent(pattern->components + pattern->count++, text + start, i - start);
+        }
+        if(text[i] == '\0') break;
+        start = i + 1;
+    }
+    pattern->directoryOnly = pattern->count > 0 && text[i-1] == '/';
+    return pattern;
+}
+
+void globFree(glob_pattern *pattern){
+    int i;
+    for(i = 0; i < pattern->count; i++){
+        free(pattern->components[i].ops);
+        free(pattern->components[i].text);
+    }
+    free(pattern->components);
+    free(pattern);
+}
+
+// Matches name against component, last star is retried one character later on mismatch
+int globMatch(glob_component *component, char *name){
+    glob_op *op = component->ops, *end = component->ops + component->opCount, *star = NULL;
+    char *starName = NULL;
+    unsigned char ch;
+    if(*name == '.' && !component->dotMatched) return 0;
+    while(*name){
+        ch = *name;
+        if(op < end && op->type == GLOB_OP_STAR){
+            star = ++op;
+            starName = name;
+            continue;
+        }
+        if(op < end && (op->type == GLOB_OP_ANY || (op->type == GLOB_OP_CHAR && op->ch == ch)
+            || (op->type == GLOB_OP_SET && op->set[ch >> 3] & (1 << (ch & 7))))){
+            name++;
+            if(op->type == GLOB_OP_ANY) while((*name & 0xC0) == 0x80) name++; // Whole multibyte character
+            op++;
+            continue;
+        }
+        if(star == NULL) return 0;
+        op = star;
+        name = ++starName;
+    }
+    while(op < end && op->type == GLOB_OP_STAR) op++;
+    return op == end;
+}
+
+void globResultAdd(glob_result *result, char *path){
+    if(result->count == result->capacity){
+        result->capacity = result->capacity * 2 + CAPACIY_INCREMENT;
+        result->paths = realloc(result->paths, sizeof(char*) * result->capacity);
+    }
+    result->paths[result->count++] = path;
+}
+
+int globIsDir(char *path){
+    struct stat st;
+    return stat(*path ? path : ".", &st) == 0 && S_ISDIR(st.st_mode);
+}
+
+void globWalk(glob_pattern *pattern, int index, char *path, glob_result *result);
+
+// Matches ** at index in path and all directories under it
+void globWalkTree(glob_pattern *pattern, int index, char *path, glob_result *result){
+    glob_dir *dir = globGetDir(path);
+    char *next;
+    int i;
+    // Zero directories, ** at end matches only what is under base unless pattern ends with / like **/
+    if(index + 1 < pattern->count || pattern->directoryOnly) globWalk(pattern, index + 1, path, result);
+    for(i = 0; i < dir->count; i++){
+        if(dir->names[dir->entries[i].name] == '.') continue;
+        next = globJoin(path, dir->names + dir->entries[i].name);
+        if(index + 1 == pattern->count && (!pattern->directoryOnly || (dir->entries[i].flags & GLOB_ENTRY_DIR))){
+            globWalk(pattern, index + 1, next, result); // ** at end matches files too
+        }
+        if(globDescends(dir, i)) globWalkTree(pattern, index, next, result);
+        free(next);
+    }
+}
+
+// Adds paths under path that match components starting from index
+void globWalk(glob_pattern *pattern, int index, char *path, glob_result *result){
+    glob_component *component;
+    glob_dir *dir;
+    struct stat st;
+    char *next;
+    int i;
+    if(index == pattern->count){
+        if(*path == '\0') return;
+        if(pattern->directoryOnly){
+            if(globIsDir(path)) globResultAdd(result, globJoin(path, ""));
+        }else if(pattern->components[index-1].type != GLOB_LITERAL || lstat(path, &st) == 0){
+            globResultAdd(result, makeStr(path, strlen(path)));
+        }
+        return;
+    }
+    component = pattern->components + index;
+    if(component->type == GLOB_LITERAL){
+        next = globJoin(path, component->text);
+        globWalk(pattern, index + 1, next, result);
+        free(next);
+    }else if(component->type == GLOB_RECURSIVE){
+        globReadTree(path);
+        globWalkTree(pattern, index, path, result);
+    }else{
+        dir = globGetDir(path);
+        for(i = 0; i < dir->count; i++){
+            if(!globMatch(component, dir->names + dir->entries[i].name)) continue;
+            next = globJoin(path, dir->names + dir->entries[i].name);
+            // Only directories can have more components, links are checked for pointing to one
+            if(index + 1 == pattern->count || (dir->entries[i].flags & GLOB_ENTRY_DIR)
+                || ((dir->entries[i].flags & GLOB_ENTRY_LINK) && globIsDir(next))){
+                globWalk(pattern, index + 1, next, result);
+            }
+            free(next);
+        }
+    }
+}
+
+int globCompare(const void *a, const void *b){
+    return strcmp(*(char**)a, *(char**)b);
+}
+
+// Returns sorted paths matching pattern without duplicates
+void globExpand(char *text, glob_result *result){
+    glob_pattern *pattern = globCompile(text);
+    int i, count = 0;
+    result->paths = NULL;
+    result->count = 0;
+    result->capacity = 0;
+    if(pattern->count > 0) globWalk(pattern, 0, pattern->absolute ? "/" : "", result);
+    globFree(pattern);
+    qsort(result->paths, result->count, sizeof(char*), globCompare);
+    for(i = 0; i < result->count; i++){
+        if(count > 0 && strcmp(result->paths[count-1], result->paths[i]) == 0) free(result->paths[i]);
+        else result->paths[count++] = result->paths[i];
+    }
+    result->count = count;
+}
+
+// Collects expanded words into args
+typedef struct{
+    char **args;
+    int count;
+    char *field; // Word that is being built
+    int length;
+    int capacity;
+    int started; // Field has content or quotes, so it is an argument even if empty
+    char *pattern; // Field with quoted characters escaped, used when it has an unquoted wildcard
+    int patternLength;
+    int patternCapacity;
+    int glob; // Field has an unquoted wildcard
+}word_expansion;
+
+void expansionAppend(word_expansion *e, char *text, long length, char quoted){
+    long i;
+    if(e->length + length + 1 > e->capacity){
+        e->capacity = (e->length + length + 1) * 2;
+        e->field = realloc(e->field, e->capacity);
+    }
+    memcpy(e->field + e->length, text, length);
+    e->length += length;
+    e->started = 1;
+    if(e->patternLength + length * 2 + 1 > e->patternCapacity){
+        e->patternCapacity = (e->patternLength + length * 2 + 1) * 2;
+        e->pattern = realloc(e->pattern, e->patternCapacity);
+    }
+    for(i = 0; i < length; i++){
+        if(strchr("*?[]\\", text[i]) == NULL || text[i] == '\0'){
+            e->pattern[e->patternLength++] = text[i];
+            continue;
+        }
+        if(quoted) e->pattern[e->patternLength++] = '\\';
+        else if(text[i] != ']') e->glob = 1;
+        e->pattern[e->patternLength++] = text[i];
+    }
+}
+
+void expansionAddArg(word_expansion *e, char *arg){
+    ADJUST_CAPACITY(e->args, e->count, 0, sizeof(char*));
+    e->args[e->count++] = arg;
+}
+
+// Adds paths matching pattern of field as args, returns 0 if nothing matched
+int expansionAddMatches(word_expansion *e){
+    glob_result result;
+    e->pattern[e->patternLength] = '\0';
+    globExpand(e->pattern, &result);
+    if(result.count == 0){
+        free(result.paths);
+        return 0;
+    }
+    // Grown at once since a pattern may match hundreds of thousands of files, capacity stays multiple of increment
+    e->args = realloc(e->args, sizeof(char*) * ((e->count + result.count) / CAPACIY_INCREMENT + 1) * CAPACIY_INCREMENT);
+    memcpy(e->args + e->count, result.paths, sizeof(char*) * result.count);
+    e->count += result.count;
+    free(result.paths);
+    return 1;
+}
+
+// Unquoted wildcards make field a pattern, it stays as is if no path matches
+void expansionEndField(word_expansion *e){
+    if(!e->started) return;
+    if(!e->glob || !expansionAddMatches(e)) expansionAddArg(e, makeStr(e->field ? e->field : "", e->length));
+    e->length = 0;
+    e->patternLength = 0;
+    e->started = 0;
+    e->glob = 0;
+}
+
+int isIfsChar(char *ifs, char ch){
+    return ch != '\0' && strchr(ifs, ch) != NULL;
+}
+
+// Appends result of an expansion, unquoted results are split into words at characters of IFS.
+// IFS whitespace around a delimiter is part of it and only other IFS characters can delimit empty words.
+void expansionAppendResult(word_expansion *e, char *text, long length, char quoted){
+    char *ifs = getVariable("IFS");
+    long i, start;
+    int delimited;
+    if(ifs == NULL) ifs = " \t\n";
+    if(quoted || ifs[0] == '\0'){
+        expansionAppend(e, text, length, quoted);
+        return;
+    }
+    for(i = 0; i < length;){
+        if(!isIfsChar(ifs, text[i])){
+            for(start = i; i < length && !isIfsChar(ifs, text[i]); i++);
+            expansionAppend(e, text + start, i - start, 0);
+            continue;
+        }
+        delimited = 0;
+        while(i < length && isIfsChar(ifs, text[i]) && IS_SPACE(text[i])) i++;
+        if(i < length && isIfsChar(ifs, text[i]) && !IS_SPACE(text[i])){
+            delimited = 1;
+            i++;
+            while(i < length && isIfsChar(ifs, text[i]) && IS_SPACE(text[i])) i++;
+        }
+        if(delimited) e->started = 1;
+        expansionEndField(e);
+    }
+}
+
+// Returns value of variable for expansion, special variables are written into buffer
+char* expansionVariable(char *name, char *buffer){
+    char *value;
+    if(strcmp(name, "?") == 0){
+        sprintf(buffer, "%d", state.lastStatus);
+        return buffer;
+    }
+    if(strcmp(name, "$") == 0){
+        sprintf(buffer, "%d", state.shellPid);
+        return buffer;
+    }
+    if(strcmp(name, "#") == 0){
+        sprintf(buffer, "%d", state.positionalCount);
+        return buffer;
+    }
+    if(isdigit(name[0])){
+        if(atoi(name) == 0) return "alpshell";
+        return atoi(name) <= state.positionalCount ? state.positional[atoi(name)-1] : "";
+    }
+    value = getVariable(name);
+    return value ? value : "";
+}
+
+// Expands parts of word, split is 0 for assignments since their value is never split into words
+void expandWord(word_expansion *e, command_token *word, int split){
+    int i, j;
+    long length;
+    char *output;
+    char buffer[32];
+    for(i = 0; i < word->partCount; i++){
+        switch (word->parts[i].type)
+        {
+        case PART_LITERAL:
+            expansionAppend(e, word->parts[i].text, strlen(word->parts[i].text), word->parts[i].quoted || !split);
+            break;
+        case PART_SUBSTITUTION:
+            disableRawMode(); // Commands of substitution use terminal like other commands
+            output = captureOutput(word->parts[i].list, &length, STDERR_FILENO);
+            enableRawMode();
+            expansionAppendResult(e, output, length, word->parts[i].quoted || !split);
+            free(output);
+            break;
+        case PART_VARIABLE:
+            if(strcmp(word->parts[i].text, "@") == 0){
+                // Each argument is a separate word even inside quotes
+                for(j = 0; j < state.positionalCount; j++){
+                    if(j > 0 && split) expansionEndField(e);
+                    else if(j > 0) expansionAppend(e, " ", 1, 1);
+                    expansionAppendResult(e, state.positional[j], strlen(state.positional[j]), word->parts[i].quoted || !split);
+                }
+                break;
+            }
+            output = expansionVariable(word->parts[i].text, buffer);
+            expansionAppendResult(e, output, strlen(output), word->parts[i].quoted || !split);
+            break;
+        }
+    }
+    expansionEndField(e);
+}
+
+// Expands tokens between start and end into args. Pipes become pipeMarker, assignments are preceded by assignMarker
+// and here-document bodies by heredocMarker.
+char** expandCommand(command_list *list, int start, int end){
+    word_expansion e;
+    int i;
+    e.args = NULL;
+    e.count = 0;
+    e.field = NULL;
+    e.length = 0;
+    e.capacity = 0;
+    e.started = 0;
+    e.pattern = NULL;
+    e.patternLength = 0;
+    e.patternCapacity = 0;
+    e.glob = 0;
+    for(i = start; i < end; i++){
+        if(list->tokens[i].type == TOKEN_PIPE){
+            expansionAddArg(&e, pipeMarker);
+        }else if(list->tokens[i].type == TOKEN_ASSIGNMENT){
+            expansionAddArg(&e, assignMarker);
+            expandWord(&e, list->tokens + i, 0);
+        }else if(list->tokens[i].type == TOKEN_HEREDOC){
+            expansionAddArg(&e, heredocMarker);
+            expandWord(&e, list->tokens + i, 0);
+        }else{
+            expandWord(&e, list->tokens + i, 1);
+        }
+    }
+    free(e.field);
+    free(e.pattern);
+    expansionAddArg(&e, NULL);
+    return e.args;
+}
+
+// Expands command of list that starts at *next and moves *next to the one after it.
+// Function definitions are done here, returns NULL when there is no command left.
+char** expandNextCommand(command_list *list, int *next){
+    command_token *token;
+    char **args;
+    int end;
+    while(*next < list->count){
+        for(end = *next; end < list->count && list->tokens[end].type != TOKEN_SEPARATOR; end++);
+        token = list->tokens + *next;
+        args = NULL;
+        if(end > *next && token->type == TOKEN_FUNCTION){
+            addDefinition(state.functions, token->parts[0].text, NULL, copyCommandList(token->body, 1));
+            state.lastStatus = 0;
+        }else if(end > *next){
+            args = expandCommand(list, *next, end);
+        }
+        *next = end + 1;
+        if(args && args[0] && args[0] != pipeMarker) return args;
+        freeArgs(args);
+    }
+    return NULL;
+}
+
+int builtinCd(char **args){
+    if(args[1] == NULL) return 0;
+    if(chdir(args[1]) < 0){
+        printf("Error: %s!", strerror(errno));
+        return 1;
+    }
+    if(getVariable("PWD")) setVariable("OLDPWD", getVariable("PWD"), -1);
+    updateCWD();
+    setVariable("PWD", state.cwd, -1);
+    return 0;
+}
+
+// export [NAME[=value]...], lists exported variables without arguments
+int builtinExport(char **args){
+    int i, result = 0;
+    shell_variable *variable;
+    if(args[1] == NULL){
+        for(i = 0; i < VARIABLE_TABLE_SIZE; i++){
+            for(variable = state.variables[i]; variable; variable = variable->next){
+                if(variable->exported) printf("export %s=\"%s\"\n\r", variable->name, variable->value);
+            }
+        }
+        return 0;
+    }
+    for(i = 1; args[i]; i++){
+        if(variableNameLength(args[i]) && args[i][variableNameLength(args[i])] == '=') assignVariable(args[i], 1);
+        else if(variableNameLength(args[i]) && args[i][variableNameLength(args[i])] == '\0') setVariable(args[i], NULL, 1);
+        else{
+            printf("Error: %s is not a valid variable name!\n\r", args[i]);
+            result = 1;
+        }
+    }
+    return result;
+}
+
+int builtinUnset(char **args){
+    int i;
+    if(args[1] && strcmp(args[1], "-f") == 0){
+        for(i = 2; args[i]; i++) removeDefinition(findDefinition(state.functions, args[i]));
+        return 0;
+    }
+    for(i = 1; args[i]; i++) unsetVariable(args[i]);
+    return 0;
+}
+
+void printAlias(shell_definition *alias){
+    printf("alias %s='%s'\n\r", alias->name, alias->text);
+}
+
+// alias name=command defines, alias name prints and alias alone lists all
+int builtinAlias(char **args){
+    shell_definition *alias;
+    command_list *body;
+    char *value, *error = NULL;
+    int i, start, result = 0;
+    if(args[1] == NULL){
+        for(i = 0; i < DEFINITION_TABLE_SIZE; i++){
+            for(alias = state.aliases[i]; alias; alias = alias->next) printAlias(alias);
+        }
+        return 0;
+    }
+    for(i = 1; args[i]; i++){
+        value = strchr(args[i], '=');
+        if(value == NULL){
+            if(*findDefinition(state.aliases, args[i])) printAlias(*findDefinition(state.aliases, args[i]));
+            else{
+                printf("Error: %s is not an alias!\n\r", args[i]);
+                result = 1;
+            }
+            continue;
+        }
+        *value++ = '\0';
+        if(args[i][0] == '\0' || strchr(args[i], '/')){
+            printf("Error: %s is not a valid alias name!\n\r", args[i]);
+            result = 1;
+            continue;
+        }
+        start = 0;
+        body = parseList(value, &start, '\0', &error);
+        if(body == NULL){
+            printf("Error: %s!\n\r", error);
+            result = 1;
+            continue;
+        }
+        addDefinition(state.aliases, args[i], value, body);
+    }
+    return result;
+}
+
+int builtinUnalias(char **args){
+    int i, result = 0;
+    if(args[1] && strcmp(args[1], "-a") == 0){
+        for(i = 0; i < DEFINITION_TABLE_SIZE; i++) while(state.aliases[i]) removeDefinition(&state.aliases[i]);
+        return 0;
+    }
+    for(i = 1; args[i]; i++){
+        if(*findDefinition(state.aliases, args[i])) removeDefinition(findDefinition(state.aliases, args[i]));
+        else{
+            printf("Error: %s is not an alias!\n\r", args[i]);
+            result = 1;
+        }
+    }
+    return result;
+}
+
+// Returns milliseconds passed since given time
+long millisecondsSince(struct timespec *start){
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (now.tv_sec - start->tv_sec) * 1000 + (now.tv_nsec - start->tv_nsec) / 1000000;
+}
+
+// Writes directly to terminal after anything buffered in stdout
+void terminalWrite(char *data, long length){
+    long result;
+    fflush(stdout);
+    if(state.recorder) recordEvent(RECORD_OUTPUT, data, length);
+    while(length > 0){
+        result = write(STDOUT_FILENO, data, length);
+        if(result < 0){
+            if(errno == EINTR) continue;
+            return;
+        }
+        data += result;
+        length -= result;
+    }
+}
+
+int varintWrite(unsigned char *buffer, unsigned long value){
+    int length = 0;
+    do{
+        buffer[length++] = (value & 0x7f) | (value > 0x7f ? 0x80 : 0);
+        value >>= 7;
+    }while(value);
+    return length;
+}
+
+// Returns -1 at end of file
+long varintRead(FILE *file){
+    unsigned long value = 0;
+    int ch, shift = 0;
+    do{
+        if((ch = fgetc(file)) == EOF) return -1;
+        value |= (unsigned long)(ch & 0x7f) << shift;
+        shift += 7;
+    }while(ch & 0x80);
+    return value;
+}
+
+// Writes buffered events to log until recording stops, buffers are swapped so shell never waits for disk
+void* recordWriter(void *data){
+    session_recorder *recorder = data;
+    char *buffer;
+    long length, written, result;
+    pthread_mutex_lock(&recorder->lock);
+    while(1){
+        while(recorder->length == 0 && !recorder->stopping) pthread_cond_wait(&recorder->ready, &recorder->lock);
+        if(recorder->length == 0) break;
+        buffer = recorder->buffer;
+        length = recorder->length;
+        recorder->buffer = recorder->spare;
+        recorder->spare = buffer;
+        result = recorder->capacity;
+        recorder->capacity = recorder->spareCapacity;
+        recorder->spareCapacity = result;
+        recorder->length = 0;
+        pthread_cond_signal(&recorder->drained);
+        pthread_mutex_unlock(&recorder->lock);
+        for(written = 0; written < length; written += result){
+            result = write(recorder->fd, buffer + written, length - written);
+            if(result < 0 && errno == EINTR) result = 0;
+            else if(result < 0) break;
+        }
+        pthread_mutex_lock(&recorder->lock);
+    }
+    pthread_mutex_unlock(&recorder->lock);
+    return NULL;
+}
+
+// Appends event to buffer of recorder, buffer grows while thread falls behind up to RECORD_BUFFER_LIMIT
+void recordEvent(char type, const char *data, long length){
+    session_recorder *recorder = state.recorder;
+    unsigned char header[32];
+    int headerLength = 1;
+    struct timespec now;
+    if(recorder == NULL || isChild) return;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    pthread_mutex_lock(&recorder->lock);
+    while(recorder->length > RECORD_BUFFER_LIMIT) pthread_cond_wait(&recorder->drained, &recorder->lock);
+    header[0] = type;
+    headerLength += varintWrite(header + headerLength, (now.tv_sec - recorder->last.tv_sec) * 1000000 + (now.tv_nsec - recorder->last.tv_nsec) / 1000);
+    headerLength += varintWrite(header + headerLength, length);
+    recorder->last = now;
+    if(recorder->length + headerLength + length > recorder->capacity){
+        recorder->capacity = (recorder->length + headerLength + length) * 2;
+        recorder->buffer = realloc(recorder->buffer, recorder->capacity);
+    }
+    memcpy(recorder->buffer + recorder->length, header, headerLength);
+    memcpy(recorder->buffer + recorder->length + headerLength, data, length);
+    recorder->length += headerLength + length;
+    recorder->events++;
+    recorder->bytes += headerLength + length;
+    if(recorder->length >= RECORD_FLUSH_SIZE || type == RECORD_COMMAND || type == RECORD_STATUS) pthread_cond_signal(&recorder->ready);
+    pthread_mutex_unlock(&recorder->lock);
+}
+
+void recordResize(){
+    unsigned char data[16];
+    int length = varintWrite(data, state.terminalWidth);
+    length += varintWrite(data + length, state.terminalHeight);
+    recordEvent(RECORD_RESIZE, (char*)data, length);
+}
+
+void recordStatus(){
+    unsigned char data[32];
+    int length;
+    if(state.recorder == NULL) return;
+    length = varintWrite(data, state.lastStatus);
+    length += varintWrite(data + length, state.lastDuration);
+    recordEvent(RECORD_STATUS, (char*)data, length);
+}
+
+// Stdout is replaced by this stream while recording, so everything printed is recorded without changing printing code
+ssize_t recordStdoutWrite(void *cookie, const char *data, size_t length){
+    ssize_t result = write(STDOUT_FILENO, data, length);
+    (void)cookie;
+    if(result > 0) recordEvent(RECORD_OUTPUT, data, result);
+    return result;
+}
+
+int recordStart(char *path){
+    session_recorder *recorder;
+    cookie_io_functions_t functions = {NULL, recordStdoutWrite, NULL, NULL};
+    FILE *stream;
+    int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if(fd < 0 || write(fd, RECORD_MAGIC, strlen(RECORD_MAGIC)) < 0){
+        printf("Error: %s!\n\r", strerror(errno));
+        if(fd >= 0) close(fd);
+        return 0;
+    }
+    recorder = malloc(sizeof(session_recorder));
+    recorder->fd = fd;
+    recorder->buffer = malloc(RECORD_BUFFER_SIZE);
+    recorder->capacity = RECORD_BUFFER_SIZE;
+    recorder->length = 0;
+    recorder->spare = malloc(RECORD_BUFFER_SIZE);
+    recorder->spareCapacity = RECORD_BUFFER_SIZE;
+    recorder->stopping = 0;
+    recorder->events = 0;
+    recorder->bytes = 0;
+    clock_gettime(CLOCK_MONOTONIC, &recorder->last);
+    pthread_mutex_init(&recorder->lock, NULL);
+    pthread_cond_init(&recorder->ready, NULL);
+    pthread_cond_init(&recorder->drained, NULL);
+    // Stream is made first so nothing can fail after writer thread is running
+    stream = fopencookie(NULL, "w", functions);
+    if(stream == NULL || pthread_create(&recorder->thread, NULL, recordWriter, recorder) != 0){
+        printf("Error: Recorder could not be started!\n\r");
+        if(stream) fclose(stream);
+        pthread_mutex_destroy(&recorder->lock);
+        pthread_cond_destroy(&recorder->ready);
+        pthread_cond_destroy(&recorder->drained);
+        close(fd);
+        free(recorder->buffer);
+        free(recorder->spare);
+        free(recorder);
+        return 0;
+    }
+    fflush(stdout);
+    setvbuf(stream, NULL, _IOLBF, BUFSIZ);
+    recorder->terminal = stdout;
+    stdout = stream;
+    state.recorder = recorder;
+    recordResize();
+    return 1;
+}
+
+// Writes what is left in buffer and closes log
+void recordStop(){
+    session_recorder *recorder = state.recorder;
+    FILE *stream = stdout;
+    fflush(stdout);
+    stdout = recorder->terminal;
+    fclose(stream);
+    state.recorder = NULL;
+    pthread_mutex_lock(&recorder->lock);
+    recorder->stopping = 1;
+    pthread_cond_signal(&recorder->ready);
+    pthread_mutex_unlock(&recorder->lock);
+    pthread_join(recorder->thread, NULL);
+    pthread_mutex_destroy(&recorder->lock);
+    pthread_cond_destroy(&recorder->ready);
+    pthread_cond_destroy(&recorder->drained);
+    close(recorder->fd);
+    free(recorder->buffer);
+    free(recorder->spare);
+    free(recorder);
+}
+
+// record FILE starts recording session, record stop ends it and record alone shows state
+int builtinRecord(char **args){
+    if(args[1] == NULL){
+        if(state.recorder) printf("Recording: %ld events, %ld bytes\n\r", state.recorder->events, state.recorder->bytes);
+        else printf("Not recording\n\r");
+        return 0;
+    }
+    if(strcmp(args[1], "stop") == 0){
+        if(state.recorder == NULL){
+            printf("Error: Not recording!\n\r");
+            return 1;
+        }
+        recordStop();
+        return 0;
+    }
+    if(state.recorder){
+        printf("Error: Already recording!\n\r");
+        return 1;
+    }
+    return !recordStart(args[1]);
+}
+
+// Reads size from a resize event
+void replayResize(FILE *file){
+    long width = varintRead(file), height = varintRead(file);
+    if(width > 0) state.terminalWidth = width;
+    if(height > 0) state.terminalHeight = height;
+}
+
+// Opens log to replay, its first event gives terminal size
+int replayOpen(char *path, int fast){
+    session_replay *replay;
+    char magic[sizeof(RECORD_MAGIC)];
+    FILE *file = fopen(path, "r");
+    if(file == NULL || fread(magic, 1, strlen(RECORD_MAGIC), file) != strlen(RECORD_MAGIC) || memcmp(magic, RECORD_MAGIC, strlen(RECORD_MAGIC)) != 0){
+        printf("Error: %s is not a session log!\n", path);
+        if(file) fclose(file);
+        return 0;
+    }
+    replay = malloc(sizeof(session_replay));
+    replay->file = file;
+    replay->fast = fast;
+    replay->time = 0;
+    replay->events = 0;
+    state.terminalWidth = 80;
+    state.terminalHeight = 24;
+    if(fgetc(file) == RECORD_RESIZE){
+        varintRead(file); // Time and length of event are not needed
+        varintRead(file);
+        replayResize(file);
+    }else{
+        fseek(file, strlen(RECORD_MAGIC), SEEK_SET);
+    }
+    clock_gettime(CLOCK_MONOTONIC, &replay->start);
+    state.replay = replay;
+    return 1;
+}
+
+// Returns next input byte from log. Waits as long as recorded session waited before it unless replay is fast,
+// events are handled while waiting. Shell exits when log ends.
+char replayInput(){
+    session_replay *replay = state.replay;
+    long delta, length, wait;
+    int type;
+    while(1){
+        if((type = fgetc(replay->file)) == EOF || (delta = varintRead(replay->file)) < 0 || (length = varintRead(replay->file)) < 0){
+            printf("\e[0m\r\nReplayed %ld events of %ld ms session in %ld ms\r\n", replay->events, replay->time / 1000, millisecondsSince(&replay->start));
+            exit(0);
+        }
+        replay->time += delta;
+        replay->events++;
+        if(type == RECORD_INPUT || type == RECORD_RESIZE){
+            while(!replay->fast && (wait = replay->time / 1000 - millisecondsSince(&replay->start)) > 0) processEvents(-1, wait);
+        }
+        if(type == RECORD_INPUT && length <= (long)sizeof(inputBuffer)){
+            inputLength = fread(inputBuffer, 1, length, replay->file);
+            inputPos = 0;
+            if(inputLength > 0) return inputBuffer[inputPos++];
+        }else if(type == RECORD_RESIZE){
+            replayResize(replay->file);
+            resizeOccured = 1;
+            return EOF; // Main loop applies new size
+        }else{
+            fseek(replay->file, length, SEEK_CUR);
+        }
+    }
+}
+
+void ringWrite(output_ring *ring, char *data, long length){
+    long position, part;
+    if(ring->data == NULL) ring->data = malloc(ring->capacity);
+    if(length > ring->capacity){ // Only last part fits
+        ring->written += length - ring->capacity;
+        data += length - ring->capacity;
+        length = ring->capacity;
+    }
+    position = ring->written % ring->capacity;
+    part = ring->capacity - position;
+    if(part > length) part = length;
+    memcpy(ring->data + position, data, part);
+    memcpy(ring->data, data + part, length - part);
+    ring->written += length;
+}
+
+// Returns oldest position that is still kept in ring
+long ringStart(output_ring *ring){
+    return ring->written > ring->capacity ? ring->written - ring->capacity : 0;
+}
+
+// Writes bytes of ring between positions from and to into fd
+void ringWriteTo(output_ring *ring, long from, long to, int fd){
+    long position, part;
+    if(from < ringStart(ring)) from = ringStart(ring);
+    while(from < to){
+        position = from % ring->capacity;
+        part = ring->capacity - position;
+        if(part > to - from) part = to - from;
+        if(fd == STDOUT_FILENO) terminalWrite(ring->data + position, part);
+        else if(write(fd, ring->data + position, part) < 0) return;
+        from += part;
+    }
+}
+
+// Opens pipe that stage reads from through /proc, so shell does not keep it open between samples
+int profileOpenInput(pid_t pid){
+    char path[64];
+    struct stat info;
+    sprintf(path, "/proc/%d/fd/0", pid);
+    if(stat(path, &info) < 0 || !S_ISFIFO(info.st_mode)) return -1;
+    return open(path, O_RDONLY | O_NONBLOCK);
+}
+
+// Records what each stage is doing and how full pipes between them are
+void profileSample(){
+    pipeline_profile *profile = state.profile;
+    stage_profile *stage;
+    char path[64];
+    char *stat, *fields;
+    int i, fd, fill, capacity;
+    int *fills = malloc(sizeof(int) * (state.stageCount + 1));
+    int *capacities = malloc(sizeof(int) * (state.stageCount + 1));
+    char *states = malloc(state.stageCount + 1);
+    while(profile->count < state.stageCount){
+        ADJUST_CAPACITY(profile->stages, profile->count, 0, sizeof(stage_profile));
+        memset(profile->stages + profile->count, 0, sizeof(stage_profile));
+        profile->count++;
+    }
+    for(i = 0; i < state.stageCount; i++){
+        sprintf(path, "/proc/%d/stat", state.stages[i].pid);
+        stat = procLine(path, "");
+        fields = stat ? strrchr(stat, ')') : NULL;
+        states[i] = fields && fields[1] ? fields[2] : 'Z';
+        free(stat);
+        fills[i] = capacities[i] = -1;
+        if(i == 0 || states[i] == 'Z' || (fd = profileOpenInput(state.stages[i].pid)) < 0) continue;
+        capacity = fcntl(fd, F_GETPIPE_SZ);
+        if(ioctl(fd, FIONREAD, &fill) == 0 && capacity > 0){
+            // Writer sleeping on a full pipe makes it wait for reader, a bigger pipe lets it run ahead
+            if(profile->grow && capacity - fill < PIPE_BUF && states[i-1] != 'R' && capacity < PROFILE_PIPE_LIMIT
+                && fcntl(fd, F_SETPIPE_SZ, capacity * 2) > 0){
+                if(profile->stages[i].grown == 0) profile->stages[i].grown = capacity;
+            }
+            fills[i] = fill;
+            capacities[i] = capacity;
+        }
+        close(fd);
+    }
+    fills[state.stageCount] = capacities[state.stageCount] = -1; // Output of last stage is read by shell
+    for(i = 0; i < state.stageCount; i++){
+        stage = profile->stages + i;
+        if(states[i] == 'Z' || states[i] == 'X') continue;
+        stage->samples++;
+        if(capacities[i] > 0){
+            stage->fill += fills[i];
+            stage->capacity = capacities[i];
+            if(capacities[i] - fills[i] < PIPE_BUF) stage->full++;
+        }
+        if(states[i] == 'R') stage->running++;
+        else if(capacities[i+1] > 0 && capacities[i+1] - fills[i+1] < PIPE_BUF) stage->outputWait++;
+        else if(fills[i] == 0) stage->inputWait++;
+    }
+    profile->samples++;
+    clock_gettime(CLOCK_MONOTONIC, &profile->lastSample);
+    free(fills);
+    free(capacities);
+    free(states);
+}
+
+// Prints how each stage of profiled pipeline spent its time, returns index of bottleneck stage
+int profileReport(){
+    pipeline_profile *profile = state.profile;
+    stage_profile *stage;
+    job_stage *job;
+    long elapsed = millisecondsSince(&profile->start);
+    int i, bottleneck = 0;
+    double run, mostRun = -1;
+    if(elapsed == 0) elapsed = 1;
+    printf("\e[0m\n\rProfile: %d stages, %ld ms, %ld samples\n\r", state.jobCount, elapsed, profile->samples);
+    printf("%5s %-12s %6s %6s %7s %7s %8s %8s %9s\n\r", "STAGE", "COMMAND", "CPU%", "BUSY%", "IN-WAIT", "OUT-WAIT", "IN MB/s", "OUT MB/s", "PIPE FILL");
+    for(i = 0; i < state.jobCount; i++){
+        job = state.job + i;
+        stage = i < profile->count ? profile->stages + i : NULL;
+        run = stage && stage->samples ? 100.0 * stage->running / stage->samples : 0;
+        if(run > mostRun){
+            mostRun = run;
+            bottleneck = i;
+        }
+        printf("%5d %-12.12s %5.1f%% %5.1f%% %6.1f%% %7.1f%% %8.1f %8.1f", i + 1, job->name, 100.0 * job->cpuTime / elapsed, run,
+            stage && stage->samples ? 100.0 * stage->inputWait / stage->samples : 0,
+            stage && stage->samples ? 100.0 * stage->outputWait / stage->samples : 0,
+            job->readBytes / 1048.576 / elapsed, job->writtenBytes / 1048.576 / elapsed);
+        if(stage && stage->capacity && stage->samples){
+            printf(" %8.1f%%", 100.0 * stage->fill / stage->samples / stage->capacity);
+            if(stage->grown) printf(" (grown %dK -> %dK)", stage->grown / 1024, stage->capacity / 1024);
+        }
+        printf("\n\r");
+    }
+    if(state.jobCount > 1 && profile->samples)
+        printf("Bottleneck: stage %d (%s), busy %.1f%% of time\n\r", bottleneck + 1, state.job[bottleneck].name, mostRun);
+    return bottleneck;
+}
+
+// Profiling starts processes of a pipeline, so it can not be a stage of one
+int builtinProfile(char **args){
+    (void)args;
+    printf("Error: profile must be at start of a command!\n\r");
+    return 2;
+}
+
+// profile [-g] PIPELINE runs pipeline and reports which stage slows it
+int runProfiled(char **args){
+    pipeline_profile profile;
+    int bottleneck;
+    profile.grow = args[1] && strcmp(args[1], "-g") == 0;
+    args += 1 + profile.grow;
+    if(*args == NULL){
+        printf("Error: Usage: profile [-g] PIPELINE!\n\r");
+        state.lastStatus = 2;
+        return -1;
+    }
+    profile.samples = 0;
+    profile.stages = NULL;
+    profile.count = 0;
+    clock_gettime(CLOCK_MONOTONIC, &profile.start);
+    profile.lastSample = profile.start;
+    state.profile = &profile;
+    runArgs(args);
+    bottleneck = profileReport();
+    state.profile = NULL;
+    free(profile.stages);
+    return bottleneck;
+}
+
+// Writes output that is not displayed yet as a single frame. If there is more than a screen of it,
+// only the last screen is written since the rest would scroll away before anyone could read it.
+// Returns new displayed position
+long relayFrame(long displayed){
+    output_ring *ring = &state.scrollback;
+    long start = ring->written;
+    long limit = (long)state.terminalHeight * state.terminalWidth;
+    int lines = 0;
+    char marker[64];
+    while(start > displayed && start > ringStart(ring) && ring->written - start < limit){
+        if(ring->data[(start-1) % ring->capacity] == '\n' && ++lines >= state.terminalHeight) break;
+        start--;
+    }
+    // Only a start moved back for truncation can be inside a character, displayed may be too when a read split one
+    if(start > displayed) while(start < ring->written && (ring->data[start % ring->capacity] & 0xC0) == 0x80) start++;
+    if(start > displayed){
+        sprintf(marker, "\e[0m\r\n\e[7m[%ld bytes skipped]\e[0m\r\n", start - displayed);
+        terminalWrite(marker, strlen(marker));
+        displayed = start;
+    }
+    ringWriteTo(ring, displayed, ring->written, STDOUT_FILENO);
+    return ring->written;
+}
+
+// Relays output of command from fd to terminal and keeps it in scrollback.
+// When throttling enabled, output collected between frames written at once so a flooding command is never slowed down by terminal.
+void relayOutput(int fd){
+    char buffer[RELAY_BUFFER_SIZE];
+    long displayed = state.scrollback.written;
+    long result;
+    int timeout, sampleTimeout;
+    struct timespec lastFrame;
+    clock_gettime(CLOCK_MONOTONIC, &lastFrame);
+    while(1){
+        timeout = -1;
+        if(state.outputFps && !isChild && displayed < state.scrollback.written){
+            timeout = 1000 / state.outputFps - millisecondsSince(&lastFrame);
+            if(timeout <= 0){ // Frame is due even if output keeps coming
+                displayed = relayFrame(displayed);
+                clock_gettime(CLOCK_MONOTONIC, &lastFrame);
+                continue;
+            }
+        }
+        if(state.profile){
+            sampleTimeout = PROFILE_INTERVAL - millisecondsSince(&state.profile->lastSample);
+            if(sampleTimeout <= 0){
+                profileSample();
+                continue;
+            }
+            if(timeout < 0 || sampleTimeout < timeout) timeout = sampleTimeout;
+        }
+        // Waits with event loop only when needed, here-documents and control requests are served while waiting
+        if(((state.outputFps && !isChild) || eventSourceCount || state.profile) && processEvents(fd, timeout) <= 0) continue;
+        result = read(fd, buffer, RELAY_BUFFER_SIZE);
+        if(result < 0 && errno == EINTR) continue;
+        if(result <= 0) break;
+        if(isChild){ // Command of a function in pipeline, shell relays it again
+            terminalWrite(buffer, result);
+            continue;
+        }
+        ringWrite(&state.scrollback, buffer, result);
+        if(state.capture) captureWrite(state.capture, buffer, result);
+        if(!state.outputFps){
+            terminalWrite(buffer, result);
+            displayed += result;
+        }
+    }
+    if(displayed < state.scrollback.written) relayFrame(displayed);
+}
+
+int builtinThrottle(char **args){
+    if(args[1] == NULL){
+        if(state.outputFps) printf("Output is written %d times per second\n\r", state.outputFps);
+        else printf("Output is written as it comes\n\r");
+        return 0;
+    }
+    if(strcmp(args[1], "off") == 0){
+        state.outputFps = 0;
+        return 0;
+    }
+    state.outputFps = atoi(args[1]);
+    if(state.outputFps <= 0 || state.outputFps > 1000){
+        state.outputFps = 0;
+        printf("Error: Frame rate has to be between 1 and 1000!\n\r");
+        return 1;
+    }
+    return 0;
+}
+
+// Saves recent output of commands into a file
+int builtinScrollback(char **args){
+    int fd;
+    if(args[1] == NULL){
+        printf("%ld bytes of output kept\n\r", state.scrollback.written - ringStart(&state.scrollback));
+        return 0;
+    }
+    fd = open(args[1], O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if(fd < 0){
+        printf("Error: %s!\n\r", strerror(errno));
+        return 1;
+    }
+    if(state.scrollback.data) ringWriteTo(&state.scrollback, ringStart(&state.scrollback), state.scrollback.written, fd);
+    close(fd);
+    return 0;
+}
+
+int builtinHistory(char **args){
+    history_record *record = state.history_last;
+    (void)args;
+    while(record && record->older) record = record->older;
+    for(; record; record = record->newer){
+        printf("%5d  ", record->number);
+        dumbPrint(record->command);
+        if(record->output && record->output->size) printf("  \e[2m[%ld bytes of output]\e[0m", record->output->size);
+        printf("\n\r");
+    }
+    return 0;
+}
+
+void outputReplayHandler(char *data, int length, void *context){
+    (void)context;
+    terminalWrite(data, length);
+}
+
+typedef struct{
+    regex_t regex;
+    char *line; // Line collected so far
+    int length;
+    int capacity;
+    int matches;
+}output_grep;
+
+void outputGrepLine(output_grep *grep){
+    grep->line[grep->length] = '\0';
+    if(regexec(&grep->regex, grep->line, 0, NULL, 0) == 0){
+        grep->line[grep->length] = '\n';
+        terminalWrite(grep->line, grep->length + 1);
+        grep->matches++;
+    }
+    grep->length = 0;
+}
+
+void outputGrepHandler(char *data, int length, void *context){
+    output_grep *grep = context;
+    int i;
+    for(i = 0; i < length; i++){
+        if(data[i] == '\n'){
+            outputGrepLine(grep);
+            continue;
+        }
+        if(grep->length + 2 > grep->capacity){
+            grep->capacity = grep->capacity * 2 + CAPACIY_INCREMENT;
+            grep->line = realloc(grep->line, grep->capacity);
+        }
+        grep->line[grep->length++] = data[i];
+    }
+}
+
+// output on [MB] | output off | output K [PATTERN]
+// Replays captured output of history entry K or prints lines of it that matches PATTERN without running command again.
+// Negative K counts back from previous command.
+int builtinOutput(char **args){
+    history_record *record = state.history_last;
+    output_grep grep;
+    int number, result;
+    if(args[1] == NULL){
+        if(state.captureLimit) printf("Last %ld MB of each command's output kept, %ld MB in memory, %ld MB in %s\n\r",
+            state.captureLimit/(1024*1024), state.captureMemory/(1024*1024), state.spillUsed/(1024*1024), "temporary file");
+        else printf("Output capturing is off\n\r");
+        return 0;
+    }
+    if(strcmp(args[1], "on") == 0){
+        state.captureLimit = (args[2] ? atol(args[2]) : 8) * 1024 * 1024;
+        if(state.captureLimit <= 0) state.captureLimit = CAPTURE_CHUNK_SIZE;
+        return 0;
+    }
+    if(strcmp(args[1], "off") == 0){
+        state.captureLimit = 0;
+        return 0;
+    }
+    number = atoi(args[1]);
+    if(number < 0){
+        if(record) record = record->older; // Skip this command
+        while(record && ++number < 0) record = record->older;
+    }else{
+        while(record && record->number != number) record = record->older;
+    }
+    if(record == NULL || record->output == NULL){
+        printf("Error: No captured output for %s!\n\r", args[1]);
+        return 1;
+    }
+    disableRawMode();
+    if(record->output->dropped) printf("\e[2m[%ld bytes dropped]\e[0m\n", record->output->dropped);
+    grep.matches = 1;
+    if(args[2] == NULL){
+        result = captureRead(record->output, outputReplayHandler, NULL);
+    }else if(regcomp(&grep.regex, args[2], REG_EXTENDED | REG_NOSUB) != 0){
+        printf("Error: Invalid pattern!\n");
+        result = 0;
+    }else{
+        grep.line = NULL;
+        grep.length = 0;
+        grep.capacity = 0;
+        grep.matches = 0;
+        result = captureRead(record->output, outputGrepHandler, &grep);
+        if(grep.length > 0) outputGrepLine(&grep);
+        regfree(&grep.regex);
+        free(grep.line);
+    }
+    fflush(stdout);
+    enableRawMode();
+    if(result == 0) return 2;
+    return grep.matches == 0; // Like grep, 1 means nothing matched
+}
+
+// Runs expanded command, builtins run in shell unless they are part of a pipeline
+void runArgs(char **args){
+    char **command;
+    shell_variable *saved;
+    int saveStdIn;
+    struct timespec startTime;
+    int *outputPipe; // 0>Reading 1>Writing
+    int i, placed;
+
+    if(args[0] != assignMarker && strcmp(args[0], "profile") == 0 && state.profile == NULL){
+        runProfiled(args);
+        return;
+    }
+    clock_gettime(CLOCK_MONOTONIC, &startTime);
+    state.lastDuration = 0;
+    for(i = 0; args[i] && args[i] != pipeMarker && args[i] != heredocMarker; i++);
+    if(args[i] == NULL && state.profile == NULL){ // Not a pipeline nor has a here-document, which needs a child to read it
+        for(command = args; *command == assignMarker; command += 2);
+        if(*command == NULL){ // Only assignments, they set shell variables
+            for(command = args; *command == assignMarker; command += 2) assignVariable(command[1], -1);
+            state.lastStatus = 0;
+            return;
+        }
+        if(*findDefinition(state.functions, command[0])){
+            saved = assignTemporary(args, command);
+            state.lastStatus = runFunction(*findDefinition(state.functions, command[0]), command);
+            restoreTemporary(saved);
+            return;
+        }
+        placed = placementWords(command);
+        for(i = 0; builtins[i].name && !(placed && command[placed]); i++){ // Placed command needs a child to apply placement to
+            if(strcmp(command[0], builtins[i].name) == 0){
+                saved = assignTemporary(args, command);
+                state.lastStatus = builtins[i].run(command);
+                restoreTemporary(saved);
+                return;
+            }
+        }
+    }
+    disableRawMode();
+    saveStdIn = dup(STDIN_FILENO);
+    
+    state.stageCount = 0;
+    outputPipe = executeCommand(args, NULL, isChild ? STDERR_FILENO : -1); // Children keep stderr they are given
+    if(outputPipe == NULL){
+        printf("Execution Error!\n\r");
+        dup2(saveStdIn, STDIN_FILENO);
+        enableRawMode();
+        state.lastStatus = 1;
+        return;
+    }
+    close(outputPipe[1]);
+    
+    relayOutput(outputPipe[0]);
+    close(outputPipe[0]);
+    heredocAbandon();
+    // Status of pipeline is status of its last stage
+    state.lastStatus = waitStages(0);
+    state.lastDuration = millisecondsSince(&startTime);
+    dup2(saveStdIn, STDIN_FILENO);
+    close(saveStdIn);
+    enableRawMode();
+    free(outputPipe);
+}
+
+// Runs commands of list one after another
+void runList(command_list *list){
+    char **args;
+    int next = 0;
+    while((args = expandNextCommand(list, &next))){
+        globCacheClear();
+        runArgs(args);
+        freeArgs(args);
+    }
+}
+
+// Runs body of function with args after name as $1, $2... Returns status of its last command.
+int runFunction(shell_definition *function, char **args){
+    char **positional = state.positional;
+    int positionalCount = state.positionalCount;
+    if(state.functionDepth >= FUNCTION_DEPTH_LIMIT){
+        printf("Error: Function calls are nested too deep!\n\r");
+        return 1;
+    }
+    state.positional = args + 1;
+    for(state.positionalCount = 0; state.positional[state.positionalCount]; state.positionalCount++);
+    state.functionDepth++;
+    function->running++;
+    state.lastStatus = 0;
+    runList(function->body);
+    if(--function->running == 0 && function->removed) freeDefinition(function);
+    state.functionDepth--;
+    state.positional = positional;
+    state.positionalCount = positionalCount;
+    return state.lastStatus;
+}
+
+void runCommand(char *command){
+    command_list *list, *expanded;
+    #if JUST_ECHO
+        //printf("\n\r");
+        dumbPrint(command);
+        return;
+    #endif
+
+    list = parseCommand(command);
+    if(list == NULL){
+        state.lastStatus = 2;
+        return;
+    }
+    // Aliases are replaced once here, functions defined by command keep replaced form
+    expanded = copyCommandList(list, 1);
+    freeCommandList(list);
+    runList(expanded);
+    freeCommandList(expanded);
+}
+
+// Writes all of data, returns -1 if fd fails
+int writeAll(int fd, const char *data, long length){
+    long result;
+    while(length > 0){
+        result = write(fd, data, length);
+        if(result < 0 && errno == EINTR) continue;
+        if(result < 0) return -1;
+        data += result;
+        length -= result;
+    }
+    return 0;
+}
+
+ssize_t lineEndWrite(void *cookie, const char *data, size_t length){
+    line_end_filter *filter = cookie;
+    char buffer[RELAY_BUFFER_SIZE];
+    long count = 0;
+    size_t i;
+    for(i = 0; i < length; i++){
+        if(data[i] == '\r' && filter->newline){
+            filter->newline = 0;
+            continue;
+        }
+        filter->newline = data[i] == '\n';
+        buffer[count++] = data[i];
+        if(count == RELAY_BUFFER_SIZE){
+            if(writeAll(filter->fd, buffer, count) < 0) return -1;
+            count = 0;
+        }
+    }
+    if(count && writeAll(filter->fd, buffer, count) < 0) return -1;
+    return length;
+}
+
+// Builtins end lines with \n\r for raw terminal, in a child whose output goes to a pipe they end with \n like other commands
+void pipeLineEnds(){
+    static line_end_filter filters[2] = {{STDOUT_FILENO, 0}, {STDERR_FILENO, 0}};
+    cookie_io_functions_t functions = {NULL, lineEndWrite, NULL, NULL};
+    FILE *stream;
+    fflush(stdout);
+    fflush(stderr);
+    if(!isatty(STDOUT_FILENO) && (stream = fopencookie(filters, "w", functions))){
+        setvbuf(stream, NULL, _IONBF, 0);
+        stdout = stream;
+    }
+    if(!isatty(STDERR_FILENO) && (stream = fopencookie(filters + 1, "w", functions))){
+        setvbuf(stream, NULL, _IONBF, 0);
+        stderr = stream;
+    }
+}
+
+void controlPutNumber(char *buffer, unsigned int number){
+    buffer[0] = number >> 24;
+    buffer[1] = number >> 16;
+    buffer[2] = number >> 8;
+    buffer[3] = number;
+}
+
+unsigned int controlGetNumber(char *buffer){
+    unsigned char *bytes = (unsigned char*)buffer;
+    return (unsigned int)bytes[0] << 24 | bytes[1] << 16 | bytes[2] << 8 | bytes[3];
+}
+
+void controlDisconnect(control_client *client){
+    if(client->fd < 0) return;
+    removeEventSource(client->fd);
+    close(client->fd);
+    client->fd = -1;
+}
+
+// Client is freed when it disconnected and none of its requests are running
+void controlClientClose(control_client *client){
+    controlDisconnect(client);
+    if(client->requests) return;
+    free(client->input);
+    free(client->output);
+    free(client);
+}
+
+// Writes queued frames as far as socket takes them without blocking, rest is written when it becomes writable
+void controlFlush(control_client *client){
+    long result, written = 0;
+    while(written < client->outputLength){
+        result = write(client->fd, client->output + written, client->outputLength - written);
+        if(result < 0 && errno == EINTR) continue;
+        if(result < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) break;
+        if(result < 0){
+            controlDisconnect(client);
+            return;
+        }
+        written += result;
+    }
+    client->outputLength -= written;
+    memmove(client->output, client->output + written, client->outputLength);
+    setEventSourceEvents(client->fd, client->outputLength ? POLLIN | POLLOUT : POLLIN);
+}
+
+void controlSend(control_client *client, char type, unsigned int id, const char *data, long length){
+    char header[CONTROL_HEADER_SIZE];
+    if(client->fd < 0) return; // Output of requests of disconnected client is dropped
+    if(client->outputLength + CONTROL_HEADER_SIZE + length > CONTROL_QUEUE_LIMIT){
+        controlDisconnect(client);
+        return;
+    }
+    header[0] = type;
+    controlPutNumber(header + 1, id);
+    controlPutNumber(header + 5, length);
+    if(client->outputCapacity < client->outputLength + CONTROL_HEADER_SIZE + length){
+        client->outputCapacity = client->outputLength + CONTROL_HEADER_SIZE + length + RELAY_BUFFER_SIZE;
+        client->output = realloc(client->output, client->outputCapacity);
+    }
+    memcpy(client->output + client->outputLength, header, CONTROL_HEADER_SIZE);
+    memcpy(client->output + client->outputLength + CONTROL_HEADER_SIZE, data, length);
+    client->outputLength += CONTROL_HEADER_SIZE + length;
+    controlFlush(client);
+}
+
+void controlReap(int fd, void *data){
+    removeEventSource(fd);
+    close(fd);
+    controlFinish(data);
+}
+
+// Called when both output pipes reached end of file, child that is still running is reaped when its pidfd
+// becomes readable so shell never blocks on it
+void controlFinish(control_request *request){
+    char data[4];
+    int status = 1, pidFd;
+    pid_t result;
+    control_client *client = request->client;
+    while((result = waitpid(request->pid, &status, WNOHANG)) == -1 && errno == EINTR);
+    if(result == 0){
+        pidFd = syscall(SYS_pidfd_open, request->pid, 0);
+        if(pidFd >= 0){
+            addEventSource(pidFd, POLLIN, controlReap, request);
+            return;
+        }
+        while((result = waitpid(request->pid, &status, 0)) == -1 && errno == EINTR); // Kernel without pidfd
+    }
+    if(result > 0) status = WIFEXITED(status) ? WEXITSTATUS(status) : 128 + WTERMSIG(status);
+    else status = 1;
+    controlPutNumber(data, status);
+    controlSend(client, CONTROL_EXIT, request->id, data, 4);
+    free(request);
+    client->requests--;
+    if(client->fd < 0) controlClientClose(client);
+}
+
+void controlForward(int fd, control_request *request, char type){
+    char buffer[RELAY_BUFFER_SIZE];
+    long result = read(fd, buffer, RELAY_BUFFER_SIZE);
+    if(result < 0 && errno == EINTR) return;
+    if(result > 0){
+        controlSend(request->client, type, request->id, buffer, result);
+        return;
     }
+    removeEventSource(fd);
+    close(fd);
+    if(--request->open == 0) controlFinish(request);
+}
 
+void controlStdout(int fd, void *data){
+    controlForward(fd, data, CONTROL_STDOUT);
 }
 
+void controlStderr(int fd, void *data){
+    controlForward(fd, data, CONTROL_STDERR);
+}
 
-void backspace(){
-    int i, j, x, moveBack = 0;
-    if(state.curPos > 0){
-        clearLine();
-        //write(STDOUT_FILENO, "\033[1D\x1b[K\e7", 9);
-        x = 1;
-        i = state.length - state.curPos;
-        state.curPos--;
-        while((state.content[state.curPos] & 0xC0) == 0x80){
-            state.curPos--;
-            x++;
+// Runs command as if it was typed, but in a child so requests run at same time and terminal is not blocked.
+// Child sees variables, functions and directory of shell, but its changes to them are not kept.
+void controlRun(control_client *client, unsigned int id, char *command){
+    int outputPipe[2], errorPipe[2];
+    int nullFd;
+    pid_t pid;
+    control_request *request;
+    char data[4];
+    if(pipe(outputPipe) == -1) goto failed;
+    if(pipe(errorPipe) == -1){
+        close(outputPipe[0]);
+        close(outputPipe[1]);
+        goto failed;
+    }
+    fflush(stdout);
+    getEnvp();
+    pid = fork();
+    if(pid == 0){
+        childInit();
+        nullFd = open("/dev/null", O_RDONLY);
+        dup2(nullFd, STDIN_FILENO);
+        close(nullFd);
+        dup2(outputPipe[1], STDOUT_FILENO);
+        dup2(errorPipe[1], STDERR_FILENO);
+        close(outputPipe[0]);
+        close(outputPipe[1]);
+        close(errorPipe[0]);
+        close(errorPipe[1]);
+        pipeLineEnds();
+        runCommand(command);
+        exit(state.lastStatus);
+    }
+    close(outputPipe[1]);
+    close(errorPipe[1]);
+    if(pid < 0){
+        close(outputPipe[0]);
+        close(errorPipe[0]);
+        goto failed;
+    }
+    request = malloc(sizeof(control_request));
+    request->client = client;
+    request->id = id;
+    request->pid = pid;
+    request->open = 2;
+    client->requests++;
+    addEventSource(outputPipe[0], POLLIN, controlStdout, request);
+    addEventSource(errorPipe[0], POLLIN, controlStderr, request);
+    return;
+failed:
+    controlPutNumber(data, 127);
+    controlSend(client, CONTROL_STDERR, id, "Error: Could not run command!\n", 30);
+    controlSend(client, CONTROL_EXIT, id, data, 4);
+}
+
+// Writes queued output when socket became writable and reads frames of client, each complete command frame starts a request
+void controlClientRead(int fd, void *data){
+    control_client *client = data;
+    long result, used = 0;
+    unsigned int length;
+    char *frame, *command;
+    if(client->outputLength) controlFlush(client);
+    if(client->fd < 0){
+        controlClientClose(client);
+        return;
+    }
+    if(client->inputCapacity - client->inputLength < RELAY_BUFFER_SIZE){
+        client->inputCapacity = client->inputCapacity * 2 + RELAY_BUFFER_SIZE;
+        client->input = realloc(client->input, client->inputCapacity);
+    }
+    result = read(fd, client->input + client->inputLength, client->inputCapacity - client->inputLength);
+    if(result < 0 && (errno == EINTR || errno == EAGAIN || errno == EWOULDBLOCK)) return;
+    if(result <= 0){
+        controlClientClose(client);
+        return;
+    }
+    client->inputLength += result;
+    while(client->inputLength - used >= CONTROL_HEADER_SIZE){
+        frame = client->input + used;
+        length = controlGetNumber(frame + 5);
+        if(frame[0] != CONTROL_COMMAND || length > CONTROL_FRAME_LIMIT){
+            controlClientClose(client);
+            return;
         }
-        state.length -= x;
-        
-        for(j = 0; j < i ; j++){
-            DEBUG("Copying: %X from %d to %d\n", HEXCHAR(state.content[state.curPos+j+x]), (state.curPos)+j+x, (state.curPos)+j);
-            state.content[state.curPos+j] = state.content[state.curPos+j+x];
+        if(client->inputLength - used < CONTROL_HEADER_SIZE + length) break;
+        command = makeStr(frame + CONTROL_HEADER_SIZE, length);
+        controlRun(client, controlGetNumber(frame + 1), command);
+        free(command);
+        if(client->fd < 0){ // Disconnected while answering
+            controlClientClose(client);
+            return;
         }
-        DEBUG("moving back %d\n", moveBack);
-        //if(moveBack>0) printf("\033[%dD", moveBack);
-        DEBUG_DUMP_STATE("Backspace end");
-        printLine();
+        used += CONTROL_HEADER_SIZE + length;
     }
+    client->inputLength -= used;
+    memmove(client->input, client->input + used, client->inputLength);
 }
 
-void delete(){
-    int i, j, x, moveBack = 0;
-    int width;
-    if(state.curPos < state.length){
-        clearLine();
-        //write(STDOUT_FILENO, "\x1b[K", 3);
-        x = 0;
-        width = getCharWidthAndSkip(state.content+state.curPos, &x);
-        //while((state.content[state.curPos+x] & 0xC0) == 0x80) x++;
-        
-        i = state.length - state.curPos;
-        for(j = 0; j < i ; j++){
-            state.content[state.curPos+j] = state.content[state.curPos+j+x];
-        }
-        //if(moveBack>2) printf("\033[%dD", moveBack-2);
-        state.length -= x;
-        printLine();
+void controlAccept(int fd, void *data){
+    control_client *client;
+    int clientFd = accept(fd, NULL, NULL);
+    (void)data;
+    if(clientFd < 0) return;
+    fcntl(clientFd, F_SETFL, O_NONBLOCK); // Client that stops reading must not block shell
+    client = malloc(sizeof(control_client));
+    client->fd = clientFd;
+    client->input = NULL;
+    client->inputLength = 0;
+    client->inputCapacity = 0;
+    client->output = NULL;
+    client->outputLength = 0;
+    client->outputCapacity = 0;
+    client->requests = 0;
+    addEventSource(clientFd, POLLIN, controlClientRead, client);
+}
+
+// Listens on a UNIX socket only user can connect to, its path is exported as ALPSHELL_CONTROL
+int controlStart(char *path){
+    struct sockaddr_un address;
+    struct stat info;
+    int fd;
+    if(strlen(path) >= sizeof(address.sun_path)){
+        printf("Error: Socket path is too long!\n\r");
+        return 0;
+    }
+    memset(&address, 0, sizeof(address));
+    address.sun_family = AF_UNIX;
+    strcpy(address.sun_path, path);
+    if(lstat(path, &info) == 0 && S_ISSOCK(info.st_mode)) unlink(path); // Left by a shell that did not exit cleanly
+    fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if(fd < 0 || bind(fd, (struct sockaddr*)&address, sizeof(address)) < 0 || chmod(path, 0600) < 0 || listen(fd, 16) < 0){
+        printf("Error: Could not listen on %s: %s!\n\r", path, strerror(errno));
+        if(fd >= 0) close(fd);
+        return 0;
     }
+    state.controlFd = fd;
+    state.controlPath = makeStr(path, strlen(path));
+    addEventSource(fd, POLLIN, controlAccept, NULL);
+    setVariable("ALPSHELL_CONTROL", path, 1);
+    return 1;
 }
 
-void commit(){
-    if(state.length > 0){
-        if(state.curPos < state.length){
-            clearLine();
-            state.curPos = state.length;
-            printLine();
+// Connected clients are served until they disconnect
+void controlStop(){
+    removeEventSource(state.controlFd);
+    close(state.controlFd);
+    unlink(state.controlPath);
+    free(state.controlPath);
+    state.controlFd = -1;
+    state.controlPath = NULL;
+}
+
+// Lays text out on cells from row like terminal would, until rows. Each cell is UTF-8 bytes of a character
+// packed into an int, 0 for second column of a wide character.
+void watchLayout(unsigned int *cells, int columns, int row, int rows, char *text, long length){
+    int column = 0, width;
+    long pos = 0, size;
+    wchar_t wc;
+    mbstate_t mbs;
+    unsigned int cell;
+    memset(&mbs, 0, sizeof(mbs));
+    while(pos < length && row < rows){
+        if(text[pos] == '\n' || text[pos] == '\r' || text[pos] == '\t'){
+            if(text[pos] == '\n') row++;
+            if(text[pos] == '\t') column = column / 8 * 8 + 8 < columns ? column / 8 * 8 + 8 : columns - 1;
+            else column = 0;
+            pos++;
+            continue;
         }
-        printf("\n\r");
-        if(state.capacity == state.length || state.capacity/state.length > 1.04){
-            fflush(stdout);
-            state.content = realloc(state.content, sizeof(char) * (state.length+1));
+        if(text[pos] == '\e'){ // Colors and other escape sequences are dropped
+            if(++pos < length && text[pos] == '[') for(pos++; pos < length && (text[pos] < 0x40 || text[pos] > 0x7E); pos++);
+            pos++;
+            continue;
         }
-        state.content[state.length] = '\0';
-        historyAdd(state.content);
-        runCommand(state.content);
-        state.content = malloc(sizeof(char) * CAPACIY_INCREMENT);
-        state.length = 0;
-        state.capacity = CAPACIY_INCREMENT;
-        state.curPos = 0;
-        state.curLine = 0;
-        state.curColumn = 3;
-    }else{
-        state.curPos = 0;
+        size = mbrtowc(&wc, text + pos, length - pos, &mbs);
+        if(size <= 0 || size > 4){ // Invalid or cut sequence is shown as ?
+            memset(&mbs, 0, sizeof(mbs));
+            wc = '?';
+            size = 1;
+        }
+        width = wcwidth(wc);
+        if(width > 0){
+            if(column + width > columns){
+                column = 0;
+                if(++row == rows) break;
+            }
+            cell = 0;
+            memcpy(&cell, wc == '?' ? "?" : text + pos, wc == '?' ? 1 : size);
+            cells[row * columns + column] = cell;
+            if(width == 2) cells[row * columns + column + 1] = 0;
+            column += width;
+        }
+        pos += size;
     }
-    state.history_pos = 0;
 }
 
-// Allocates new command string to command variable and returns array of pointers that points to locations in that string.
-char** parseCommand(char **command){
-    char ch; //temp to store character that currently being processsed.
-    int i = 0; // Position in old command string
-    int newI = 0; // Position in new command string
-    int add;
-    int argCount = 0;
-    int argLength = 0;
-    char *oldStr = *command;
-    char escapes = 0;
-    char *newStr = malloc(sizeof(char)*(CAPACIY_INCREMENT + 4));
-    char *argStarts = malloc(sizeof(char*)*(CAPACIY_INCREMENT+2));;
-    char** args; // = malloc(sizeof(char*)*(CAPACIY_INCREMENT+1));
-    
-    while(oldStr[i]){
-        ch = oldStr[i];
-        
-        ADJUST_CAPACITY(argStarts, argCount, 2, sizeof(char*));
-        ADJUST_CAPACITY(newStr, newI, 4, sizeof(char*));
-
-        if(escapes){
-            add = 0;
-            if(escapes & 0x8){
-                escapes = escapes ^ 0x8;
-                add = 1;
-            }else if(escapes & 0x4){
-                if(ch == '\'') escapes = 0;
-                else add = 1;
-            }else{ 
-                if(ch == '\"') escapes = 0;
-                else add = 1;
-            }
-            if(add){
-                if(argLength == 0) argStarts[argCount++] = newI; 
-                newStr[newI++] = ch;
-                argLength++;
-            }
-        }else{
-            switch (ch)
-            {
-            case '|':
-                if(argLength > 0){
-                    newStr[newI++] = '\0';
-                    argLength = 0;
+// Writes cells that differ from previous frame with cursor addressing
+void watchDraw(unsigned int *cells, unsigned int *previous, int rows, int columns){
+    int row, column, index, moved, gap;
+    char bytes[5];
+    bytes[4] = '\0';
+    for(row = 0; row < rows; row++){
+        moved = 0;
+        for(column = 0; column < columns; column++){
+            index = row * columns + column;
+            if(cells[index] == previous[index]){
+                for(gap = 1; gap < 4 && column + gap < columns && cells[index+gap] == previous[index+gap]; gap++);
+                // Few unchanged cells before a changed one are written again, it is shorter than moving cursor
+                if(!moved || gap == 4 || column + gap == columns){
+                    moved = 0;
+                    continue;
                 }
-                argStarts[argCount++] = newI;
-                //newStr[newI++] = '|';
-                newStr[newI++] = '\0'; //Empty string means pipe
-                break;
-            case ' ':
-                if(argLength > 0){
-                    newStr[newI++] = '\0';
-                    argLength = 0;
+            }
+            if(!moved){
+                if(cells[index] == 0 && column > 0){ // Wide character is written from its first column
+                    column--;
+                    index--;
                 }
-                break;
-            case '\\':
-                escapes = 0x8;
-                break;
-            case '\'':
-                escapes = 0x4;
-                break;
-            case '\"':
-                escapes = 0x2;
-                break;
-            default:
-                if(argLength == 0) argStarts[argCount++] = newI;
-                newStr[newI++] = ch;
-                argLength++;
-                break;
+                printf("\e[%d;%dH", row + 1, column + 1);
+                moved = 1;
             }
+            if(cells[index] == 0) continue;
+            memcpy(bytes, cells + index, 4);
+            printf("%s", bytes);
         }
-        i++;
-    }
-    if(argCount == 0){
-        free(args);
-        free(newStr);
-        return NULL;
     }
-    if(argLength > 0) newStr[newI] = '\0';
-    args = malloc( sizeof(char*) * (argCount+1));
-    for(i = 0; i< argCount ; i++) args[i] = newStr+argStarts[i];
-    free(argStarts);
-    args[argCount] = 0;
-    *command = newStr;
-    return args;
 }
 
-// Checks if there is an open escape in current command, return 1 for nonclosed escape, returns 0 if all escapes are finished
-char getEscapeStatus(){
+// watch [-n SECONDS] COMMAND reruns command on alternate screen until q is pressed, only changed cells are redrawn
+int builtinWatch(char **args){
+    long interval = 2000, wait, previousWait = 0, duration, length, previousLength = 0, size = 0, timeout;
+    double seconds;
+    int i = 1, rows = 0, columns = 0, full, quit = 0, result;
+    char *command, *output, *previousOutput = NULL, *end;
+    char header[512], changed[16] = "";
+    command_list *list, *expanded;
+    unsigned int *cells = NULL, *previous = NULL, *swap, blank = 0, timeCells[8];
+    struct timespec start;
+    time_t now;
     char ch;
-    int i;
-    char escapes = 0;
-    
-    for(i = 0; i < state.length; i++){
-        ch = state.content[i];
-
-        if(escapes){
-            if(escapes & 0x8){
-                escapes = escapes ^ 0x8;
-            }else if(escapes & 0x4){
-                if(ch == '\'') escapes = 0;
-            }else{ 
-                if(ch == '\"') escapes = 0;
-            }
-        }else{
-            switch (ch)
-            {
-            case '\\':
-                escapes = 0x8;
-                break;
-            case '\'':
-                escapes = 0x4;
-                break;
-            case '\"':
-                escapes = 0x2;
-                break;
-            }
+    if(isChild){
+        printf("Error: watch needs terminal!\n\r");
+        return 1;
+    }
+    if(args[1] && strcmp(args[1], "-n") == 0 && args[2]){
+        seconds = strtod(args[2], &end);
+        if(end == args[2] || *end != '\0' || !(seconds >= 0) || seconds > 86400){
+            printf("Error: Invalid interval %s!\n\r", args[2]);
+            return 2;
         }
+        interval = seconds * 1000;
+        if(interval < 100) interval = 100;
+        i = 3;
     }
-    return escapes;
-}
-
-// Executes command and returns a pipe
-int* executeCommand(char **args, int *inputPipe){
-    int execResult;
-    int pid;
-    int pipeOperator = 0;
-    
-    int *outputPipe = malloc(sizeof(int)*2);
-    if (pipe(outputPipe)==-1){
-        printf("Pipe Error!\n\r");
-        exit(1);
+    if(args[i] == NULL){
+        printf("Error: Usage: watch [-n SECONDS] COMMAND!\n\r");
+        return 2;
     }
-
-    while(args[pipeOperator] && !(args[pipeOperator][0] == '\0') ) pipeOperator++;
-    if(args[pipeOperator] == NULL)
-        pipeOperator = 0;
-    
-    
-    pid = fork();
-    if(pid < 0){
-        printf("Fork Error!\n\r");
-        free(outputPipe);
-        return NULL;
+    // Words are joined so a quoted pipeline like 'ps | head' is run as one command
+    for(length = i; args[length]; length++) size += strlen(args[length]) + 1;
+    command = malloc(size);
+    command[0] = '\0';
+    for(; args[i]; i++){
+        strcat(command, args[i]);
+        if(args[i+1]) strcat(command, " ");
     }
-    if(pid > 0){
-        //parent
-        if(pipeOperator){
-            //In this case outputPipe will be used between childs so this process (parent) has no business with it
-            //But if we close both end pipe will be closed so we let read end open and close write end
-            //We have to close writing end otherwise child which reads it may hang forever.
-            close(outputPipe[1]);
-            return executeCommand(args+pipeOperator+1, outputPipe);
-        }else
-            return outputPipe;
-            
+    list = parseCommand(command);
+    if(list == NULL){
+        free(command);
+        return 2;
     }
-    isChild = 1;
-    close(outputPipe[0]); // Close reading end of output pipe
-    //child
-    //Check if there is a pipe operator
-    if(pipeOperator) args[pipeOperator] = NULL;
-    if(inputPipe){
-        close(STDIN_FILENO);
-        close(inputPipe[1]); // Close writing end of input pipe
-        dup2(inputPipe[0], STDIN_FILENO);
-        //close(inputPipe[0]);
+    expanded = copyCommandList(list, 1);
+    freeCommandList(list);
+    memcpy(&blank, " ", 1);
+    wait = interval;
+    printf("\e[?1049h\e[?25l");
+    while(!quit){
+        if(resizeOccured){
+            reloadTerminalWidth();
+            recordResize();
+            resizeOccured = 0;
+        }
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        output = captureOutput(expanded, &length, -1);
+        duration = millisecondsSince(&start);
+        // Wait is time between end of a run and start of next, it grows for slow command so it does not keep machine busy
+        if(duration > interval) wait = wait * 2 < interval * WATCH_BACKOFF_LIMIT ? wait * 2 : interval * WATCH_BACKOFF_LIMIT;
+        else wait = interval;
+        full = rows != state.terminalHeight || columns != state.terminalWidth;
+        if(full){
+            rows = state.terminalHeight;
+            columns = state.terminalWidth;
+            cells = realloc(cells, sizeof(unsigned int) * rows * columns);
+            previous = realloc(previous, sizeof(unsigned int) * rows * columns);
+            for(i = 0; i < rows * columns; i++) previous[i] = blank; // Cleared screen is previous frame
+            printf("\e[2J");
+        }
+        if(previousOutput == NULL || length != previousLength || memcmp(output, previousOutput, length) != 0){
+            now = time(NULL);
+            strftime(changed, sizeof(changed), "%H:%M:%S", localtime(&now));
+        }else if(!full && wait == previousWait){ // Nothing to redraw
+            free(output);
+            output = NULL;
+        }
+        if(output){
+            for(i = 0; i < rows * columns; i++) cells[i] = blank;
+            if(wait == interval) snprintf(header, sizeof(header), "Every %.1fs: %s", interval / 1000.0, command);
+            else snprintf(header, sizeof(header), "Every %.1fs (slowed to %.1fs): %s", interval / 1000.0, wait / 1000.0, command);
+            watchLayout(cells, columns, 0, 1, header, strlen(header));
+            if(columns > 20){ // Time of last change is at right
+                watchLayout(timeCells, 8, 0, 1, changed, strlen(changed));
+                memcpy(cells + columns - 8, timeCells, sizeof(timeCells));
+            }
+            watchLayout(cells, columns, 2, rows, output, length);
+            watchDraw(cells, previous, rows, columns);
+            fflush(stdout);
+            swap = previous;
+            previous = cells;
+            cells = swap;
+            free(previousOutput);
+            previousOutput = output;
+            previousLength = length;
+            previousWait = wait;
+        }
+        // Waits before next run, q or Ctrl-C quits, space reruns command at once.
+        // Keys are read at least once even if no time is left.
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        do{
+            timeout = wait - millisecondsSince(&start);
+            if(timeout < 0) timeout = 0;
+            result = inputPos < inputLength ? 1 : processEvents(STDIN_FILENO, timeout);
+            if(result < 0 && resizeOccured) break;
+            if(result <= 0) continue;
+            ch = readInput();
+            if(ch == 'q' || ch == 3 || ch == 4) quit = 1;
+            else if(ch == ' ') break;
+        }while(!quit && millisecondsSince(&start) < wait);
     }
-    setvbuf(stdout, NULL, _IONBF, 0);
-    setvbuf(stdin, NULL, _IONBF, 0);
-    dup2(outputPipe[1], STDOUT_FILENO);
-    dup2(outputPipe[1], STDERR_FILENO);
-    execResult = execvp(args[0], args);
-    if(execResult < 0) printf("Error: %s!\n\r", strerror(errno));     
-    fclose(stderr);
-    fclose(stdout);
-    fclose(stdin);
-    close(outputPipe[1]);
-    close(outputPipe[0]);
-    exit(0);
+    printf("\e[?25h\e[?1049l");
+    free(previousOutput);
+    free(cells);
+    free(previous);
+    free(command);
+    freeCommandList(expanded);
+    return state.lastStatus;
 }
 
-void runCommand(char *command){
-    int saveStdIn;
-    pid_t pid;
-    char lastch = 0;
-    char buffer[11];
-    int *outputPipe; // 0>Reading 1>Writing
-    int result, i;
-    char *tempCommandStr = command;
-    char **args = parseCommand(&tempCommandStr);
-    #if JUST_ECHO
-        //printf("\n\r");
-        dumbPrint(command);
-        return;
-    #endif
-
-    if(args == NULL) return;
-    if(strcmp(args[0], "cd") == 0){
-        if(args[1] == NULL) return;
-        if(chdir(args[1]) < 0){
-            printf("Error: %s!", strerror(errno));
-        }
-        updateCWD();
-        free(tempCommandStr);
-        free(args);
-        return;
-    }
-    disableRawMode();
-    saveStdIn = dup(STDIN_FILENO);
-    
-    outputPipe = executeCommand(args, NULL);
-    if(outputPipe == NULL){
-        printf("Execution Error!\n\r");
-        dup2(saveStdIn, STDIN_FILENO);
-        enableRawMode();
-        return;
+// control PATH listens on socket, control stop closes it and control alone shows state
+int builtinControl(char **args){
+    if(args[1] == NULL){
+        if(state.controlFd >= 0) printf("Listening on %s\n\r", state.controlPath);
+        else printf("Not listening\n\r");
+        return 0;
     }
-    close(outputPipe[1]);
-    
-    while( ( result = read(outputPipe[0], buffer, 10) ) > 0){
-        for(i = 0; i < result; i++){
-            putchar(buffer[i]);
+    if(strcmp(args[1], "stop") == 0){
+        if(state.controlFd < 0){
+            printf("Error: Not listening!\n\r");
+            return 1;
         }
-        fflush(stdout);
+        controlStop();
+        return 0;
     }
-    wait(NULL);
-    dup2(saveStdIn, STDIN_FILENO);
-    enableRawMode();
-    free(tempCommandStr);
-    free(args);
-    free(outputPipe);
+    if(state.controlFd >= 0){
+        printf("Error: Already listening!\n\r");
+        return 1;
+    }
+    return !controlStart(args[1]);
 }
 
 
+// Terminal mode belongs to shell, so children running functions or builtins do not change it
 void enableRawMode(){
+    if(isChild) return;
     tcgetattr(STDIN_FILENO, &termios_config);
     struct termios raw = termios_config;
     // ECHO : Echo input characters.
@@ -828,6 +5179,7 @@ void enableRawMode(){
     tcsetattr(STDIN_FILENO, TCSAFLUSH, &raw);
 }
 void disableRawMode(){
+    if(isChild) return;
     tcsetattr(STDIN_FILENO, TCSAFLUSH, &termios_config);
 }
 
@@ -838,15 +5190,31 @@ void resizeEventHandler(int signal){
 
 
 void runAtExit(){
+    int i;
     if(isChild) return; // Only main process should run this at exit
-    system("clear");
+    if(state.recorder) recordStop();
+    if(state.controlFd >= 0) controlStop();
+    if(state.replay == NULL) system("clear"); // Summary of replay stays
     disableRawMode();
     free(state.content);
+    free(state.tokens);
+    free(state.prompt);
+    free(state.stages);
+    jobFree();
+    free(state.placement.cgroup);
+    free(state.scrollback.data);
+    if(state.spillFile) fclose(state.spillFile);
+    free(state.spillFree);
+    freeVariables();
+    commandCacheClear();
     if(state.draft) free(state.draft);
+    free(state.edits.data);
+    for(i = 0; i < KILL_RING_SIZE; i++) free(state.killRing[i]);
     while(state.history_last){
         state.history_pos = state.history_last;
         state.history_last = state.history_last->older;
         free(state.history_pos->command);
+        captureFree(state.history_pos->output);
         free(state.history_pos);
     }
     #if DEBUG_ENABLED
@@ -856,6 +5224,8 @@ void runAtExit(){
 
 static inline void stateInit(){
     state.cwd = 0;
+    state.cwdGeneration = 0;
+    state.prompt = NULL;
     updateCWD();
     state.content = malloc(sizeof(char) * CAPACIY_INCREMENT);
     state.length = 0;
@@ -870,14 +5240,87 @@ static inline void stateInit(){
     state.curColumn = state.startingColumn;
     state.curLine =0;
     state.posSync = 0;
-   
+    state.tokens = NULL;
+    state.tokenCount = 0;
+    state.tokenCapacity = 0;
+    state.color = SYNTAX_ARGUMENT;
+    state.promptChanged = 0;
+    state.lastStatus = 0;
+    state.lastDuration = 0;
+    state.stages = NULL;
+    state.job = NULL;
+    state.jobCount = 0;
+    state.placement.hasCpus = 0;
+    state.placement.hasNice = 0;
+    state.placement.ioPriority = -1;
+    state.placement.cgroup = NULL;
+    state.profile = NULL;
+    state.stageCount = 0;
+    state.outputFps = 0;
+    state.scrollback.data = NULL;
+    state.scrollback.capacity = SCROLLBACK_SIZE;
+    state.scrollback.written = 0;
+    state.captureLimit = 0;
+    state.captureMemory = 0;
+    state.capture = NULL;
+    state.spillFile = NULL;
+    state.spillSize = 0;
+    state.spillUsed = 0;
+    state.spillFree = NULL;
+    state.spillFreeCount = 0;
+    state.envp = NULL;
+    state.envpValid = 0;
+    state.shellPid = getpid();
+    importEnvironment();
+    state.positional = NULL;
+    state.positionalCount = 0;
+    state.functionDepth = 0;
+    state.heredocWriters = 0;
+    state.recorder = NULL;
+    state.replay = NULL;
+    state.controlFd = -1;
+    state.controlPath = NULL;
+    memset(&state.edits, 0, sizeof(edit_log));
+    memset(state.killRing, 0, sizeof(state.killRing));
+    state.killTop = 0;
+    state.action = 0;
+    state.lastAction = 0;
 }
 
+#if CAPTURE_BENCHMARK
+    // Captures outputs of different sizes through command substitution and prints throughput
+    void captureBenchmark(){
+        long sizes[] = {1024, 64*1024, 1024*1024, 10*1024*1024, 100*1024*1024, 0};
+        char command[64];
+        char *output;
+        long length, elapsed;
+        int i, j, repeat;
+        struct timespec start;
+        command_list *list;
+        for(i = 0; sizes[i]; i++){
+            sprintf(command, "head -c %ld /dev/zero", sizes[i]);
+            list = parseCommand(command);
+            repeat = sizes[i] < 1024*1024 ? 100 : 3;
+            clock_gettime(CLOCK_MONOTONIC, &start);
+            for(j = 0; j < repeat; j++){
+                output = captureOutput(list, &length, STDERR_FILENO);
+                free(output);
+            }
+            elapsed = millisecondsSince(&start);
+            printf("%10ld bytes: %8.2f ms per capture, %8.1f MB/s\n", length, (double)elapsed/repeat,
+                elapsed ? (double)sizes[i]*repeat/(1024*1024)/(elapsed/1000.0) : 0);
+            freeCommandList(list);
+        }
+    }
+#endif
+
 int main(int argc, char *argv[]){
     struct sigaction sa; // struct for registration for resize signal
     int escapeSequence = 0; // Stores the state of escape sequence
     char ch;
     int processed = 0;
+    char *recordPath = NULL, *replayPath = NULL, *controlPath = NULL;
+    int fast = 0, i;
     
     setlocale (LC_ALL,""); //Sets all locales to system default
     
@@ -887,6 +5330,23 @@ int main(int argc, char *argv[]){
 
     stateInit(3);
 
+    for(i = 1; i < argc; i++){
+        if(strcmp(argv[i], "--record") == 0 && i + 1 < argc) recordPath = argv[++i];
+        else if(strcmp(argv[i], "--replay") == 0 && i + 1 < argc) replayPath = argv[++i];
+        else if(strcmp(argv[i], "--fast") == 0) fast = 1;
+        else if(strcmp(argv[i], "--control") == 0 && i + 1 < argc) controlPath = argv[++i];
+        else{
+            printf("Usage: %s [--record FILE] [--replay FILE [--fast]] [--control SOCKET]\n", argv[0]);
+            return 1;
+        }
+    }
+    if(replayPath && !replayOpen(replayPath, fast)) return 1;
+
+    #if CAPTURE_BENCHMARK
+        captureBenchmark();
+        return 0;
+    #endif
+
     if( atexit(runAtExit) != 0){
         printf("Failed to register exit function!\n");
         exit(1);
@@ -896,6 +5356,8 @@ int main(int argc, char *argv[]){
     system("clear");
     write(STDOUT_FILENO, "\x1b[2J", 4);
     reloadTerminalWidth();
+    if(recordPath && !recordStart(recordPath)) exit(1);
+    if(controlPath && !controlStart(controlPath)) exit(1);
     printf("Welcome to AlpShell - Press CTRL-D to quit");
     NEW_LINE();
 
@@ -903,11 +5365,23 @@ int main(int argc, char *argv[]){
     sa.sa_flags = 0;
     sa.sa_handler = resizeEventHandler;
     if(sigaction(SIGWINCH, &sa, NULL) == -1) printf("Error when setting up SIGWINCH signal handler!\n\r");
+    signal(SIGPIPE, SIG_IGN); // Writing here-document to a command that exited must not kill shell
 
 
     while(1){
-        ch = getchar();
-        if(ch == EOF) continue; // Signal handler prints EOF to stdin.
+        //We need to do this here to avoid inturrupting multibyte char sequences
+        if(!state.expectedBytes){
+            if(resizeOccured){
+                reloadTerminalWidth();
+                recordResize();
+                //reloadLine(statePtr);
+                resizeOccured = 0;
+            }
+            if(state.promptChanged) repaintPrompt();
+        }
+
+        ch = readInput();
+        if(ch == EOF) continue; // Signals and events interrupts reading
         processed = 0;
 
         if(escapeSequence == 3){
@@ -945,11 +5419,28 @@ int main(int argc, char *argv[]){
             if(escapeSequence == 2) escapeSequence = 0;
         
         }else if(escapeSequence == 1){
-            if(ch == '['){
-                escapeSequence = 2;
-                processed = 1;
-            }else{
-                escapeSequence = 0;
+            processed = 1;
+            escapeSequence = 0;
+            switch (ch)
+            {
+                case '[':
+                    escapeSequence = 2;
+                    break;
+                case 'd': // Alt-D
+                    killNextWord();
+                    break;
+                case 127: // Alt-Backspace
+                    killPreviousWord(0);
+                    break;
+                case 'y': // Alt-Y
+                    yankRotate();
+                    break;
+                case '_': // Alt-_
+                    redo();
+                    break;
+                default:
+                    processed = 0;
+                    break;
             }
         }
 
@@ -959,9 +5450,11 @@ int main(int argc, char *argv[]){
             switch (ch)
             {
                 case 3: // CTRL-C
+                    editLogClear();
                     goToEnd();
                     state.length = 0;
                     state.curPos = 0;
+                    state.tokenCount = 0;
                     state.history_pos = NULL;
                     printf("^C");
                     NEW_LINE();
@@ -984,6 +5477,21 @@ int main(int argc, char *argv[]){
                 case 127: // backspace
                     backspace();
                     break;
+                case 11: // CTRL-K
+                    killRange(state.curPos, state.length, 0);
+                    break;
+                case 21: // CTRL-U
+                    killRange(0, state.curPos, 1);
+                    break;
+                case 23: // CTRL-W
+                    killPreviousWord(1);
+                    break;
+                case 25: // CTRL-Y
+                    yank();
+                    break;
+                case 31: // CTRL-_
+                    undo();
+                    break;
                 default:
                     //printf("(C:%d)",ch);
                     break;
@@ -994,12 +5502,9 @@ int main(int argc, char *argv[]){
         if(processed == 0){
             addChar(ch);
         }        
-
-        //We need to do this here to avoid inturrupting multibyte char sequences
-        if(resizeOccured && !state.expectedBytes){
-            reloadTerminalWidth();
-            //reloadLine(statePtr);
-            resizeOccured = 0;
+        if(escapeSequence == 0 && state.expectedBytes == 0){ // Key is complete, kills and yanks look at previous one
+            state.lastAction = state.action;
+            state.action = 0;
         }
     }
 
@@ -1,5 +1,15 @@
 #!/bin/bash
+# ./run.sh test builds and runs each test in tests/, each one includes main.c with its own main
+if [ "$1" = "test" ]; then
+    status=0
+    for test in tests/*_test.c; do
+        gcc -pthread -o "${test%.c}" "$test" || exit 1
+        "./${test%.c}" < /dev/null || status=1
+        rm -f "${test%.c}"
+    done
+    exit $status
+fi
 rm main
-gcc -o main main.c
+gcc -pthread -o main main.c
 read -p "Press enter to continue"
-./main
\ No newline at end of file
+./main
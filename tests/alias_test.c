@@ -0,0 +1,33 @@
+// Calls functions that use aliases and checks their output.
+// Built and run by ./run.sh test
+#define main alpshellMain
+#include "../main.c"
+#undef main
+
+// Runs setup like a typed command, then checks output of command
+int aliasTestCase(char *setup, char *command, char *expected){
+    command_list *list, *expanded;
+    char *output;
+    long length;
+    int passed;
+    runCommand(setup);
+    list = parseCommand(command);
+    expanded = copyCommandList(list, 1);
+    output = captureOutput(expanded, &length, -1);
+    passed = length == (long)strlen(expected) && memcmp(output, expected, length) == 0;
+    if(!passed) printf("%s gave \"%.*s\", expected \"%s\"\n", command, (int)length, output, expected);
+    free(output);
+    freeCommandList(expanded);
+    freeCommandList(list);
+    return passed;
+}
+
+int main(){
+    int passed;
+    stateInit();
+    passed = aliasTestCase("alias hi='echo ALIASED'; g() { hi there; }", "g", "ALIASED there");
+    passed &= aliasTestCase("h() { hi; hi again; }", "h", "ALIASED\nALIASED again");
+    passed &= aliasTestCase("alias hi='echo CHANGED'", "g", "ALIASED there"); // Body keeps alias as it was when defined
+    printf("Alias test %s\n", passed ? "passed" : "failed");
+    return !passed;
+}
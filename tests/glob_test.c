@@ -0,0 +1,38 @@
+// Expands recursive patterns in a temporary directory tree and checks results.
+// Built and run by ./run.sh test
+#define main alpshellMain
+#include "../main.c"
+#undef main
+
+// Checks sorted matches of pattern against expected paths separated by spaces
+int globTestCase(char *text, char *expected){
+    glob_result result;
+    char joined[256] = "";
+    int i;
+    globExpand(text, &result);
+    for(i = 0; i < result.count; i++){
+        if(i) strcat(joined, " ");
+        strncat(joined, result.paths[i], sizeof(joined) - strlen(joined) - 2);
+        free(result.paths[i]);
+    }
+    free(result.paths);
+    if(strcmp(joined, expected) == 0) return 1;
+    printf("%s gave \"%s\", expected \"%s\"\n", text, joined, expected);
+    return 0;
+}
+
+int main(){
+    char dir[] = "/tmp/alpshell-glob-XXXXXX", command[64];
+    int passed;
+    stateInit();
+    if(mkdtemp(dir) == NULL || chdir(dir) != 0) return 1;
+    if(system("mkdir -p g/a/b && touch g/a/x g/a/b/y g/z") != 0) return 1;
+    passed = globTestCase("g/a/**", "g/a/b g/a/b/y g/a/x"); // Trailing ** does not match base itself
+    passed &= globTestCase("g/**/y", "g/a/b/y");
+    passed &= globTestCase("g/**/", "g/ g/a/ g/a/b/");
+    passed &= globTestCase("g/a/**/*", "g/a/b g/a/b/y g/a/x");
+    snprintf(command, sizeof(command), "rm -rf %s", dir);
+    if(chdir("/") != 0 || system(command) != 0) passed = 0;
+    printf("Glob test %s\n", passed ? "passed" : "failed");
+    return !passed;
+}
@@ -0,0 +1,20 @@
+// Profiles a pipeline whose middle stage is slow and checks it is found as bottleneck.
+// Built and run by ./run.sh test
+#define main alpshellMain
+#include "../main.c"
+#undef main
+
+// Compressing random data is much slower than reading and counting it, so gzip has to be found as bottleneck
+int main(){
+    command_list *list;
+    char **args;
+    int next = 0, bottleneck;
+    stateInit();
+    list = parseCommand("profile head -c 20000000 /dev/urandom | gzip -9 | wc -c");
+    args = expandNextCommand(list, &next);
+    bottleneck = runProfiled(args);
+    freeArgs(args);
+    freeCommandList(list);
+    printf("Profile test %s\n", bottleneck == 1 ? "passed" : "failed");
+    return bottleneck != 1;
+}